@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <time.h>
+#include "heap.h"
+
+// Per-operation cost of header control sums: the old byte-by-byte sum against wordsSum,
+// and heap_malloc/heap_free pairs which resum headers on every call.
+// Build it like main.c, once as is and once with -DHEAP_NO_CHECKSUM to compare.
+
+#define ITERATIONS 1000000
+
+double nowNs(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+int32_t byteSum(const void* memory, size_t size)
+{
+    int32_t sum = 0;
+    for(const uint8_t* start = memory; start != (const uint8_t*)memory + size; ++start)
+        sum += *start;
+    return sum;
+}
+
+int main()
+{
+    static Chunk chunk;
+    static Heap heap;
+    volatile int32_t sink = 0;
+
+    double start = nowNs();
+    for(int i = 0; i < ITERATIONS; ++i)
+    {
+        chunk.size = i;
+        sink += byteSum(&chunk, sizeof(Chunk));
+    }
+    double byteChunk = (nowNs() - start) / ITERATIONS;
+
+    start = nowNs();
+    for(int i = 0; i < ITERATIONS; ++i)
+    {
+        chunk.size = i;
+        sink += wordsSum(&chunk, sizeof(Chunk));
+    }
+    double wordChunk = (nowNs() - start) / ITERATIONS;
+
+    start = nowNs();
+    for(int i = 0; i < ITERATIONS / 10; ++i)
+    {
+        heap.chunksCount.free = i;
+        sink += byteSum(&heap, sizeof(Heap));
+    }
+    double byteHeap = (nowNs() - start) / (ITERATIONS / 10);
+
+    start = nowNs();
+    for(int i = 0; i < ITERATIONS / 10; ++i)
+    {
+        heap.chunksCount.free = i;
+        sink += wordsSum(&heap, sizeof(Heap));
+    }
+    double wordHeap = (nowNs() - start) / (ITERATIONS / 10);
+
+    if(heap_setup() != 0)
+        return 1;
+    void* keep = heap_malloc(64); // keeps the freed block from merging with the tail
+    start = nowNs();
+    for(int i = 0; i < ITERATIONS; ++i)
+        heap_free(heap_malloc(64));
+    double mallocFree = (nowNs() - start) / ITERATIONS;
+    heap_free(keep);
+
+    printf("Chunk header (%zu bytes): byte sum %.1f ns, word sum %.1f ns\n", sizeof(Chunk), byteChunk, wordChunk);
+    printf("Heap (%zu bytes): byte sum %.1f ns, word sum %.1f ns\n", sizeof(Heap), byteHeap, wordHeap);
+    printf("heap_malloc + heap_free: %.1f ns\n", mallocFree);
+    return sink == 42;
+}
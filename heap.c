@@ -1,9 +1,81 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sched.h>
+#include <stdlib.h>
 #include "heap.h"
 #include "custom_unistd.h"
-#include <stdio.h>
 #include <pthread.h>
-Heap heap;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+Arena defaultArena = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+_Atomic(Arena*) arenaPool[ARENAS_MAX]; // slot 0 stands for defaultArena
+atomic_uint arenaPoolSize = 1;
+Arena* privateArenas = NULL; // guarded by arenasMutex
+ArenaRange privateRanges[PRIVATE_ARENA_SLOTS];
+atomic_uint privateRangesSize = 0;
+atomic_uint privateArenasSpilled = 0; // arenas past the slots, only the list knows them
+pthread_mutex_t arenasMutex = PTHREAD_MUTEX_INITIALIZER;
+atomic_uint arenaCount = 1;
+atomic_int arenaAssignment = assign_round_robin;
+atomic_uint arenaNextIndex = 0;
+__thread Arena* boundArena = NULL;
+__thread int threadArenaIndex = -1;
+__thread ThreadCache threadCache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+ThreadCache* threadCaches = NULL; // guarded by threadCachesMutex
+pthread_mutex_t threadCachesMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t threadCacheKey;
+pthread_once_t threadCacheKeyOnce = PTHREAD_ONCE_INIT;
+atomic_size_t threadCacheLimit = 0;
+atomic_bool slabEnabled = false;
+atomic_size_t trimThreshold = 0;
+atomic_size_t mmapThreshold = 0;
+atomic_int placementPolicy = placement_segregated;
+atomic_size_t deferredLimit = 0;
+atomic_bool adaptiveLocks = false;
+LargeBlock* largeBlocks = NULL; // sorted by address, guarded by largeBlocksMutex
+size_t largeBlocksCount = 0;
+atomic_size_t osBytes = 0, osPeakBytes = 0; // every arena and large block mapping
+size_t largeBlocksCapacity = 0;
+pthread_mutex_t largeBlocksMutex = PTHREAD_MUTEX_INITIALIZER;
+ArenaStats largeTotals; // mapped bytes, blocks and largest size, guarded by largeBlocksMutex
+StatsSeqlock largeStats; // largeTotals for readers that don't take the mutex
+atomic_size_t profileRate = 0;
+__thread intptr_t profileBytesLeft = 0;
+__thread uint64_t profileRandom = 0;
+pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t profileStart = 0;
+ProfileSite profileSites[PROFILE_SITES]; // open addressing on (fileName, lineNumber)
+ProfileSample profileSamples[PROFILE_SAMPLES];
+ProfileSample* profileBuckets[PROFILE_SAMPLES]; // live samples by address
+ProfileSample* profileFreeSamples = NULL;
+size_t profileSamplesUsed = 0;
+atomic_ushort profileFilter[PROFILE_FILTER_SIZE]; // live samples per address hash, read without the lock
+atomic_bool traceActive = false;
+uint64_t traceStart = 0;
+uint32_t traceThreads = 0;
+TraceBuffer* traceBuffers = NULL; // guarded by traceMutex
+pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+int traceFd = -1; // guarded by traceWriteMutex, taken after buffer locks
+bool traceFailed = false;
+pthread_mutex_t traceWriteMutex = PTHREAD_MUTEX_INITIALIZER;
+__thread TraceBuffer traceBuffer = { .lock = PTHREAD_MUTEX_INITIALIZER };
+pthread_key_t traceKey;
+pthread_once_t traceKeyOnce = PTHREAD_ONCE_INIT;
+ValidatorCursor validatorCursor = { 0 };
+pthread_mutex_t validatorMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_t validatorThread;
+pthread_mutex_t validatorThreadMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t validatorWake = PTHREAD_COND_INITIALIZER;
+bool validatorRunning = false; // guarded by validatorThreadMutex
+size_t validatorBudget = 0;
+unsigned int validatorInterval = 0;
+atomic_bool validatorFailed = false;
+#if defined(HEAP_COMPACT_HEADER) && defined(HEAP_CHUNK_DEBUG)
+_Atomic(ChunkDebug*) chunkSidecar[SIDECAR_REGIONS]; // mapped on first use
+#endif
 
 
 void ConsoleLog(char* function, char* log)
@@ -13,77 +85,637 @@ void ConsoleLog(char* function, char* log)
 
 int heap_setup(void)
 {
-    if(heap.isInitialized){
+    if(defaultArena.heap.isInitialized){
         ConsoleLog(__f, "Heap exists");
         return 0;
     }
-    void* space = custom_sbrk(PAGE_SIZE);
-    if(space == (void*)-1) {
+    if(atomic_load(&adaptiveLocks))
+        arenaMutexInit(&defaultArena.mutex);
+    if(arenaSetup(&defaultArena) != 0) {
         ConsoleLog(__f, "Not enough memory for heap");
         return -1;
     }
-    setBoundaries(space);
-    heap.head = heap.boundaries.leftBound;
-    heap.tail = heap.boundaries.rightBound;
-    heap.chunksCount.free = 1;
-    heap.chunksCount.used = 2; // boundaries
-    heap.isInitialized = true;
-    heap.firstFence = heap.secondFence = RANDOM_FENCE_VALUE;
-    heapSetSum();
     return 0;
 }
-void setBoundaries(void* space)
+int heap_set_option(enum heap_option_t option, size_t value)
+{
+    switch(option)
+    {
+        case option_thread_cache_limit:
+            atomic_store(&threadCacheLimit, value);
+            return 0;
+        case option_arena_count:
+            if(value == 0 || value > ARENAS_MAX)
+                break;
+            atomic_store(&arenaCount, value);
+            return 0;
+        case option_arena_assignment:
+            if(value != assign_round_robin && value != assign_by_cpu)
+                break;
+            atomic_store(&arenaAssignment, value);
+            return 0;
+        case option_slab_allocator:
+            atomic_store(&slabEnabled, value != 0);
+            return 0;
+        case option_trim_threshold:
+            atomic_store(&trimThreshold, value);
+            return 0;
+        case option_mmap_threshold:
+            atomic_store(&mmapThreshold, value);
+            return 0;
+        case option_profile_sample_rate:
+            pthread_mutex_lock(&profileMutex);
+            if(value != 0 && atomic_load(&profileRate) == 0)
+                profileStart = profileNow();
+            atomic_store(&profileRate, value);
+            pthread_mutex_unlock(&profileMutex);
+            return 0;
+        case option_placement_policy:
+            if(value > placement_best_fit)
+                break;
+            // Trees are kept from the start, so existing heaps can't switch
+            if(defaultArena.heap.isInitialized)
+            {
+                ConsoleLog(__f, "Placement policy can only be set before heap_setup");
+                return -1;
+            }
+            atomic_store(&placementPolicy, value);
+            return 0;
+        case option_deferred_coalescing:
+            atomic_store(&deferredLimit, value);
+            return 0;
+        case option_adaptive_locks:
+#ifndef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+            if(value != 0)
+            {
+                ConsoleLog(__f, "Adaptive locks aren't supported");
+                return -1;
+            }
+#endif
+            // Arena mutexes are set up with the arenas
+            if(defaultArena.heap.isInitialized)
+            {
+                ConsoleLog(__f, "Lock type can only be set before heap_setup");
+                return -1;
+            }
+            atomic_store(&adaptiveLocks, value != 0);
+            return 0;
+    }
+    ConsoleLog(__f, "Invalid option");
+    return -1;
+}
+int arenaSetup(Arena* arena)
+{
+    Heap* heap = &arena->heap;
+    void* space = arenaSbrk(arena, PAGE_SIZE);
+    if(space == (void*)-1)
+        return -1;
+    if(chunkMapSetup(heap, arena->reserved ? arena->reserved : ARENA_RESERVE) != 0)
+    {
+        arenaSbrk(arena, -PAGE_SIZE);
+        return -1;
+    }
+    // Whole page starts as used, setBoundaries moves the free chunk out of it
+    heap->chunksCount.free = 0;
+    heap->chunksCount.used = 2; // boundaries
+    heap->chunksCount.freeBytes = 0;
+    heap->chunksCount.usedBytes = PAGE_SIZE;
+    setBoundaries(heap, space);
+    heap->head = heap->boundaries.leftBound;
+    heap->tail = heap->boundaries.rightBound;
+    heap->isInitialized = true;
+    heap->firstFence = heap->secondFence = RANDOM_FENCE_VALUE;
+    heapSetSum(heap);
+    statsPublish(arena);
+    return 0;
+}
+void* arenaSbrk(Arena* arena, intptr_t size)
+{
+    void* space;
+    if(arena->reserved == 0)
+    {
+        // Chunk map only covers ARENA_RESERVE bytes of the sbrk region
+        if(arena->base != NULL && size > 0 && atomic_load(&arena->end) + size - (uintptr_t)arena->base > ARENA_RESERVE)
+            return (void*)-1;
+        space = custom_sbrk(size);
+        if(space == (void*)-1)
+            return space;
+        if(size > 0 && !sidecarReserve(space, size))
+        {
+            custom_sbrk(-size);
+            return (void*)-1;
+        }
+        if(arena->base == NULL)
+            arena->base = space;
+    }
+    else
+    {
+        uintptr_t end = atomic_load(&arena->end);
+        if(size > 0 && (uintptr_t)size > (uintptr_t)arena->base + arena->reserved - end)
+            return (void*)-1;
+        space = (void*)end;
+        if(size > 0 && !sidecarReserve(space, size))
+            return (void*)-1;
+        if(size < 0)
+            madvise((uint8_t*)end + size, -size, MADV_DONTNEED);
+    }
+    atomic_store(&arena->end, (uintptr_t)space + size);
+    statsOsBytes(size);
+    return space;
+}
+void arenaUnlock(Arena* arena)
+{
+    // Every unlock after a change to the heap publishes its counters
+    statsPublish(arena);
+    pthread_mutex_unlock(&arena->mutex);
+}
+void statsPublish(Arena* arena)
+{
+    // Caller holds the arena lock, so there's a single writer
+    Heap* heap = &arena->heap;
+    ArenaStats stats = {
+        .usedChunks = heap->chunksCount.used,
+        .freeChunks = heap->chunksCount.free,
+        .usedBytes = heap->chunksCount.usedBytes,
+        .freeBytes = heap->chunksCount.freeBytes,
+        .largestFree = heapLargestFreeArea(heap),
+        .largestUsed = heapLargestUsedBlockSize(heap),
+    };
+    statsStore(&arena->stats, &stats);
+}
+void statsStore(StatsSeqlock* stats, const ArenaStats* in)
+{
+    unsigned int sequence = atomic_load_explicit(&stats->sequence, memory_order_relaxed);
+    atomic_store_explicit(&stats->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&stats->usedChunks, in->usedChunks, memory_order_relaxed);
+    atomic_store_explicit(&stats->freeChunks, in->freeChunks, memory_order_relaxed);
+    atomic_store_explicit(&stats->usedBytes, in->usedBytes, memory_order_relaxed);
+    atomic_store_explicit(&stats->freeBytes, in->freeBytes, memory_order_relaxed);
+    atomic_store_explicit(&stats->largestFree, in->largestFree, memory_order_relaxed);
+    atomic_store_explicit(&stats->largestUsed, in->largestUsed, memory_order_relaxed);
+    atomic_store_explicit(&stats->sequence, sequence + 2, memory_order_release);
+}
+void statsRead(StatsSeqlock* stats, ArenaStats* out)
+{
+    // Lock-free, a read that overlaps a store is retried
+    unsigned int sequence;
+    do
+    {
+        sequence = atomic_load_explicit(&stats->sequence, memory_order_acquire);
+        out->usedChunks = atomic_load_explicit(&stats->usedChunks, memory_order_relaxed);
+        out->freeChunks = atomic_load_explicit(&stats->freeChunks, memory_order_relaxed);
+        out->usedBytes = atomic_load_explicit(&stats->usedBytes, memory_order_relaxed);
+        out->freeBytes = atomic_load_explicit(&stats->freeBytes, memory_order_relaxed);
+        out->largestFree = atomic_load_explicit(&stats->largestFree, memory_order_relaxed);
+        out->largestUsed = atomic_load_explicit(&stats->largestUsed, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while((sequence & 1) != 0 || atomic_load_explicit(&stats->sequence, memory_order_relaxed) != sequence);
+}
+void arenaMutexInit(pthread_mutex_t* mutex)
+{
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+#ifdef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+    // Spins for a while before it sleeps in the kernel, short critical sections rarely get that far
+    if(atomic_load(&adaptiveLocks))
+        pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+    pthread_mutex_init(mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+Arena* arenaMap(size_t reserve, bool isPrivate)
+{
+    // Arena itself takes the first page of the mapping
+    size_t size = ceilWord(reserve);
+    if(size % PAGE_SIZE != 0)
+        size += PAGE_SIZE - size % PAGE_SIZE;
+    size += PAGE_SIZE;
+    uint8_t* space = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(space == MAP_FAILED)
+        return NULL;
+    Arena* arena = (Arena*)space;
+    arenaMutexInit(&arena->mutex);
+    arena->base = space + PAGE_SIZE;
+    arena->reserved = size - PAGE_SIZE;
+    atomic_init(&arena->end, (uintptr_t)arena->base);
+    arena->isPrivate = isPrivate;
+    if(arenaSetup(arena) != 0)
+    {
+        munmap(space, size);
+        return NULL;
+    }
+    return arena;
+}
+Arena* poolArena(unsigned int index)
+{
+    pthread_mutex_lock(&arenasMutex);
+    Arena* arena = atomic_load(&arenaPool[index]);
+    if(arena == NULL)
+    {
+        arena = arenaMap(ARENA_RESERVE, false);
+        if(arena != NULL)
+        {
+            atomic_store(&arenaPool[index], arena);
+            if(atomic_load(&arenaPoolSize) <= index)
+                atomic_store(&arenaPoolSize, index + 1);
+        }
+    }
+    pthread_mutex_unlock(&arenasMutex);
+    return arena;
+}
+Arena* threadArena(void)
+{
+    if(boundArena != NULL)
+        return boundArena;
+    unsigned int count = atomic_load_explicit(&arenaCount, memory_order_relaxed);
+    if(count <= 1 || defaultArena.heap.isInitialized == false)
+        return &defaultArena;
+    unsigned int index;
+    if(atomic_load_explicit(&arenaAssignment, memory_order_relaxed) == assign_by_cpu)
+    {
+        int cpu = sched_getcpu();
+        index = cpu < 0 ? 0 : (unsigned int)cpu % count;
+    }
+    else
+    {
+        if(threadArenaIndex < 0)
+            threadArenaIndex = atomic_fetch_add(&arenaNextIndex, 1);
+        index = (unsigned int)threadArenaIndex % count;
+    }
+    if(index == 0)
+        return &defaultArena;
+    Arena* arena = atomic_load_explicit(&arenaPool[index], memory_order_acquire);
+    if(arena == NULL)
+        arena = poolArena(index);
+    return arena != NULL ? arena : &defaultArena;
+}
+Arena* sharedArenaOf(const void* pointer)
+{
+    uintptr_t address = (uintptr_t)pointer;
+    if(defaultArena.base != NULL && address >= (uintptr_t)defaultArena.base && address < atomic_load(&defaultArena.end))
+        return &defaultArena;
+    unsigned int size = atomic_load(&arenaPoolSize);
+    for(unsigned int index = 1; index < size; ++index)
+    {
+        Arena* arena = atomic_load(&arenaPool[index]);
+        if(arena != NULL && address >= (uintptr_t)arena->base && address < atomic_load(&arena->end))
+            return arena;
+    }
+    return NULL;
+}
+void privateRangeSet(ArenaRange* range, Arena* arena)
+{
+    // Caller holds arenasMutex, NULL empties the slot
+    unsigned int sequence = atomic_load_explicit(&range->sequence, memory_order_relaxed);
+    atomic_store_explicit(&range->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&range->begin, arena ? (uintptr_t)arena->base : 0, memory_order_relaxed);
+    atomic_store_explicit(&range->limit, arena ? (uintptr_t)arena->base + arena->reserved : 0, memory_order_relaxed);
+    atomic_store_explicit(&range->arena, arena, memory_order_relaxed);
+    atomic_store_explicit(&range->sequence, sequence + 2, memory_order_release);
+}
+Arena* privateArenaOf(const void* pointer)
+{
+    // Ranges are compared without touching the arenas, one may be unmapped meanwhile
+    uintptr_t address = (uintptr_t)pointer;
+    unsigned int size = atomic_load_explicit(&privateRangesSize, memory_order_acquire);
+    for(unsigned int index = 0; index < size; ++index)
+    {
+        ArenaRange* range = &privateRanges[index];
+        unsigned int sequence;
+        uintptr_t begin, limit;
+        Arena* arena;
+        do
+        {
+            sequence = atomic_load_explicit(&range->sequence, memory_order_acquire);
+            begin = atomic_load_explicit(&range->begin, memory_order_relaxed);
+            limit = atomic_load_explicit(&range->limit, memory_order_relaxed);
+            arena = atomic_load_explicit(&range->arena, memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+        } while((sequence & 1) != 0 || atomic_load_explicit(&range->sequence, memory_order_relaxed) != sequence);
+        if(arena != NULL && address >= begin && address < limit)
+            return arena;
+    }
+    if(atomic_load_explicit(&privateArenasSpilled, memory_order_relaxed) == 0)
+        return NULL;
+    Arena* arena;
+    pthread_mutex_lock(&arenasMutex);
+    for(arena = privateArenas; arena != NULL; arena = arena->next)
+        if(address >= (uintptr_t)arena->base && address < atomic_load(&arena->end))
+            break;
+    pthread_mutex_unlock(&arenasMutex);
+    return arena;
+}
+Arena* arenaOf(const void* pointer)
+{
+    Arena* arena = sharedArenaOf(pointer);
+    if(arena == NULL)
+        arena = privateArenaOf(pointer);
+    // Unknown pointers are reported by the default arena
+    return arena != NULL ? arena : &defaultArena;
+}
+unsigned int sharedArenas(Arena** arenas)
+{
+    unsigned int count = 0;
+    arenas[count++] = &defaultArena;
+    unsigned int size = atomic_load(&arenaPoolSize);
+    for(unsigned int index = 1; index < size; ++index)
+    {
+        Arena* arena = atomic_load(&arenaPool[index]);
+        if(arena != NULL)
+            arenas[count++] = arena;
+    }
+    return count;
+}
+bool remoteFree(void* memblock)
+{
+    // Same lock-free checks as threadCacheFree, anything doubtful takes the locked path
+    Arena* arena = sharedArenaOf(memblock);
+    Chunk* chunk = (Chunk*)memblock - 1;
+    if(arena == NULL || chunk <= arena->heap.head || (intptr_t)memblock % sizeof(void*) != 0)
+        return false;
+    if(!chunkMapTest(&arena->heap, chunk))
+        return false;
+#ifdef HEAP_CHUNK_DEBUG
+    if(chunkDebug(chunk)->firstFence != RANDOM_FENCE_VALUE || chunkDebug(chunk)->secondFence != RANDOM_FENCE_VALUE)
+        return false;
+#endif
+    if(chunk->isFree || chunk->isSlab || chunk->size < sizeof(RemoteBlock))
+        return false;
+    RemoteBlock* block = memblock;
+    uintptr_t key = (uintptr_t)arena ^ RANDOM_FENCE_VALUE;
+    // Data can hold the key by chance, the locked path drains the queue and tells the cases apart
+    if(block->key == key)
+        return false;
+    block->key = key;
+    block->next = atomic_load_explicit(&arena->remoteFrees, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&arena->remoteFrees, &block->next, block, memory_order_release, memory_order_relaxed));
+    return true;
+}
+void heapDrainRemote(Heap* heap)
+{
+    // Caller holds the arena lock; the queue is taken whole, so pushes never wait for it
+    Arena* arena = (Arena*)heap;
+    if(atomic_load_explicit(&arena->remoteFrees, memory_order_relaxed) == NULL)
+        return;
+    RemoteBlock* block = atomic_exchange_explicit(&arena->remoteFrees, NULL, memory_order_acquire);
+    void* memblocks[REMOTE_DRAIN_BATCH];
+    while(block != NULL)
+    {
+        size_t count = 0;
+        for(; block != NULL && count < REMOTE_DRAIN_BATCH; block = block->next)
+        {
+            block->key = 0;
+            memblocks[count++] = block;
+        }
+        qsort(memblocks, count, sizeof(void*), comparePointers);
+        heapFreeBatch(heap, memblocks, count);
+    }
+}
+
+Arena* heap_arena_create(size_t size)
+{
+    if(defaultArena.heap.isInitialized == false)
+    {
+        ConsoleLog(__f, "Heap isn't initialized");
+        return NULL;
+    }
+    Arena* arena = arenaMap(size ? size : ARENA_RESERVE, true);
+    if(arena == NULL)
+    {
+        ConsoleLog(__f, "Couldn't reserve memory for arena");
+        return NULL;
+    }
+    pthread_mutex_lock(&arenasMutex);
+    arena->prev = NULL;
+    arena->next = privateArenas;
+    if(privateArenas != NULL)
+        privateArenas->prev = arena;
+    privateArenas = arena;
+    unsigned int ranges = atomic_load(&privateRangesSize), index = 0;
+    while(index < ranges && atomic_load_explicit(&privateRanges[index].arena, memory_order_relaxed) != NULL)
+        index++;
+    if(index < PRIVATE_ARENA_SLOTS)
+    {
+        privateRangeSet(&privateRanges[index], arena);
+        if(index == ranges)
+            atomic_store_explicit(&privateRangesSize, ranges + 1, memory_order_release);
+    }
+    else
+        atomic_fetch_add(&privateArenasSpilled, 1);
+    pthread_mutex_unlock(&arenasMutex);
+    return arena;
+}
+void heap_arena_destroy(Arena* arena)
+{
+    if(arena == NULL || arena->isPrivate == false)
+    {
+        ConsoleLog(__f, "Only arenas from heap_arena_create can be destroyed");
+        return;
+    }
+    pthread_mutex_lock(&arenasMutex);
+    // A pinned arena is being written out by heap_snapshot, it stays linked until that's done
+    while(arena->pins != 0)
+    {
+        pthread_mutex_unlock(&arenasMutex);
+        sched_yield();
+        pthread_mutex_lock(&arenasMutex);
+    }
+    if(arena->prev != NULL)
+        arena->prev->next = arena->next;
+    else
+        privateArenas = arena->next;
+    if(arena->next != NULL)
+        arena->next->prev = arena->prev;
+    unsigned int ranges = atomic_load(&privateRangesSize), index = 0;
+    while(index < ranges && atomic_load_explicit(&privateRanges[index].arena, memory_order_relaxed) != arena)
+        index++;
+    if(index < ranges)
+        privateRangeSet(&privateRanges[index], NULL);
+    else
+        atomic_fetch_sub(&privateArenasSpilled, 1);
+    pthread_mutex_unlock(&arenasMutex);
+    if(boundArena == arena)
+        boundArena = NULL;
+    // Every block goes away with the mapping
+    profileForget(arena->base, arena->base + arena->reserved);
+    statsOsBytes(-(intptr_t)(atomic_load(&arena->end) - (uintptr_t)arena->base));
+    munmap(arena->heap.chunkMap, arena->heap.mapSpan);
+    pthread_mutex_destroy(&arena->mutex);
+    munmap(arena, arena->reserved + PAGE_SIZE);
+}
+void* heap_arena_malloc(Arena* arena, size_t count)
+{
+    if(arena == NULL)
+    {
+        ConsoleLog(__f, "Invalid arena");
+        return NULL;
+    }
+    pthread_mutex_lock(&arena->mutex);
+    void* memory = heapMalloc(&arena->heap, count, 0, NULL);
+    arenaUnlock(arena);
+    profileMalloc(memory, count, 0, NULL);
+    traceRecord(trace_malloc, memory, NULL, count, 0);
+    return memory;
+}
+void* heap_arena_calloc(Arena* arena, size_t number, size_t size)
+{
+    if(arena == NULL)
+    {
+        ConsoleLog(__f, "Invalid arena");
+        return NULL;
+    }
+    pthread_mutex_lock(&arena->mutex);
+    void* memory = heapCalloc(&arena->heap, number, size, 0, NULL);
+    arenaUnlock(arena);
+    profileMalloc(memory, number * size, 0, NULL);
+    traceRecord(trace_calloc, memory, NULL, number * size, 0);
+    return memory;
+}
+void heap_thread_set_arena(Arena* arena)
+{
+    boundArena = arena;
+}
+void setBoundaries(Heap* heap, void* space)
 {
-    heap.boundaries.leftBound = (Chunk*)space;
-    Chunk* freeChunk = heap.boundaries.leftBound + 1;
-    heap.boundaries.rightBound = (Chunk*)((uchar*)space + PAGE_SIZE) - 1;
-    heap.boundaries.leftBound->prev = heap.boundaries.rightBound->next = NULL;
-    heap.boundaries.rightBound->prev = heap.boundaries.leftBound->next = freeChunk;
-    heap.boundaries.leftBound->size = heap.boundaries.rightBound->size = EMPTY;
-    heap.boundaries.leftBound->isFree = heap.boundaries.rightBound->isFree =  false;
+    heap->boundaries.leftBound = (Chunk*)space;
+    Chunk* freeChunk = heap->boundaries.leftBound + 1;
+    heap->boundaries.rightBound = (Chunk*)((uchar*)space + PAGE_SIZE) - 1;
+    heap->boundaries.leftBound->prev = heap->boundaries.rightBound->next = NULL;
+    heap->boundaries.rightBound->prev = heap->boundaries.leftBound->next = freeChunk;
+    heap->boundaries.leftBound->size = heap->boundaries.rightBound->size = EMPTY;
+    heap->boundaries.leftBound->isFree = heap->boundaries.rightBound->isFree =  false;
+    heap->boundaries.leftBound->isSlab = heap->boundaries.rightBound->isSlab = freeChunk->isSlab = false;
+    heap->boundaries.leftBound->isQuick = heap->boundaries.rightBound->isQuick = freeChunk->isQuick = false;
     // setFirstFreeBlock
-    freeChunk->next = heap.boundaries.rightBound;
-    freeChunk->prev = heap.boundaries.leftBound;
+    freeChunk->next = heap->boundaries.rightBound;
+    freeChunk->prev = heap->boundaries.leftBound;
     freeChunk->isFree = true;
     freeChunk->size = PAGE_SIZE - 3 * sizeof(Chunk);
-    setFences(3, heap.boundaries.leftBound, heap.boundaries.rightBound, freeChunk);
-    setSum(3, heap.boundaries.leftBound, heap.boundaries.rightBound, freeChunk);
+    heap->boundaries.leftBound->nextFree = heap->boundaries.leftBound->prevFree = NULL;
+    heap->boundaries.rightBound->nextFree = heap->boundaries.rightBound->prevFree = NULL;
+    setFences(3, heap->boundaries.leftBound, heap->boundaries.rightBound, freeChunk);
+    chunkMapSet(heap, heap->boundaries.leftBound, true);
+    chunkMapSet(heap, freeChunk, true);
+    chunkMapSet(heap, heap->boundaries.rightBound, true);
+    binInsert(heap, freeChunk);
+    setSum(3, heap->boundaries.leftBound, heap->boundaries.rightBound, freeChunk);
 }
 void setFences(int countOfChunks, ...)
 {
+#ifdef HEAP_CHUNK_DEBUG
     va_list list;
     va_start(list, countOfChunks);
     for(unsigned int i=0; i<countOfChunks; ++i)
     {
         Chunk* chunk = va_arg(list, Chunk*);
-        chunk->firstFence = RANDOM_FENCE_VALUE;
-        chunk->secondFence = RANDOM_FENCE_VALUE;
+        chunkDebug(chunk)->firstFence = RANDOM_FENCE_VALUE;
+        chunkDebug(chunk)->secondFence = RANDOM_FENCE_VALUE;
     }
     va_end(list);
+#endif
 }
 void setSum(int countOfChunks, ...)
 {
+#ifdef HEAP_CHECKSUM
     va_list list;
     va_start(list, countOfChunks);
-    int32_t sum;
     for(unsigned int i=0; i<countOfChunks; ++i)
     {
         Chunk* chunk = va_arg(list, Chunk*);
-        sum = chunk->sumOfBytes = 0;
-        for(uchar* start = (uchar*)chunk; start != (uchar*)(chunk+1); ++start)
-            sum += *start;
-        chunk->sumOfBytes = sum;
+        chunkDebug(chunk)->sumOfBytes = 0;
+        int32_t sum = wordsSum(chunk, sizeof(Chunk));
+#ifdef HEAP_COMPACT_HEADER
+        sumField(&sum, chunkDebug(chunk), sizeof(ChunkDebug), 1);
+#endif
+        chunkDebug(chunk)->sumOfBytes = sum;
     }
     va_end(list);
+#endif
+}
+void setDebugParams(Chunk* chunk, int fileline, const char* filename)
+{
+#ifdef HEAP_CHUNK_DEBUG
+    chunkDebug(chunk)->debugParams.lineNumber = fileline;
+    chunkDebug(chunk)->debugParams.fileName = filename;
+#endif
+}
+bool sidecarReserve(const void* space, size_t size)
+{
+#if defined(HEAP_COMPACT_HEADER) && defined(HEAP_CHUNK_DEBUG)
+    // Maps the sidecar regions of new heap memory up front, so every chunk has its own entry
+    uintptr_t first = (uintptr_t)space >> SIDECAR_REGION_SHIFT;
+    uintptr_t last = ((uintptr_t)space + size - 1) >> SIDECAR_REGION_SHIFT;
+    if(last >= SIDECAR_REGIONS)
+    {
+        ConsoleLog(__f, "Memory lies outside the debug sidecar");
+        return false;
+    }
+    for(uintptr_t index = first; index <= last; ++index)
+    {
+        if(atomic_load_explicit(&chunkSidecar[index], memory_order_acquire) != NULL)
+            continue;
+        size_t bytes = ((size_t)1 << (SIDECAR_REGION_SHIFT - SIDECAR_GRANULE_SHIFT)) * sizeof(ChunkDebug);
+        ChunkDebug* region = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(region == MAP_FAILED)
+        {
+            ConsoleLog(__f, "Couldn't map debug sidecar");
+            return false;
+        }
+        ChunkDebug* expected = NULL;
+        if(!atomic_compare_exchange_strong(&chunkSidecar[index], &expected, region))
+            munmap(region, bytes);
+    }
+#else
+    (void)space;
+    (void)size;
+#endif
+    return true;
+}
+#if defined(HEAP_COMPACT_HEADER) && defined(HEAP_CHUNK_DEBUG)
+ChunkDebug* chunkDebug(const Chunk* chunk)
+{
+    // Heap memory only comes through arenaSbrk, which has mapped the region already
+    uintptr_t address = (uintptr_t)chunk;
+    ChunkDebug* region = atomic_load_explicit(&chunkSidecar[address >> SIDECAR_REGION_SHIFT], memory_order_acquire);
+    return region + ((address & (((uintptr_t)1 << SIDECAR_REGION_SHIFT) - 1)) >> SIDECAR_GRANULE_SHIFT);
 }
-void heapSetSum()
+#endif
+void heapSetSum(Heap* heap)
 {
-    uchar* end = (uchar*)((Heap*)&heap + 1);
-    int32_t sum;
-    sum = heap.sumOfBytes = 0;
-    for(uchar* start = (uchar*)&heap; start != end; ++start)
-        sum += *start;
-    heap.sumOfBytes = sum;
+#ifdef HEAP_CHECKSUM
+    heap->sumOfBytes = 0;
+    heap->sumOfBytes = wordsSum(heap, sizeof(Heap));
+#endif
+}
+// Sums are taken over 32-bit words, so callers pass 4-byte aligned fields and structs
+typedef uint32_t __attribute__((may_alias)) SumWord;
+int32_t wordsSum(const void* memory, size_t size)
+{
+    uint32_t sum = 0;
+    const SumWord* words = memory;
+    for(size_t i = 0; i < size / sizeof(SumWord); ++i)
+        sum += words[i];
+    return (int32_t)sum;
+}
+// Moves a field in or out of a control sum, so changing it doesn't need a full resum
+void sumField(int32_t* sum, const void* field, size_t size, int sign)
+{
+#ifdef HEAP_CHECKSUM
+    uint32_t words = (uint32_t)wordsSum(field, size);
+    *sum = (int32_t)(sign > 0 ? (uint32_t)*sum + words : (uint32_t)*sum - words);
+#endif
+}
+void setChunkLink(Chunk* chunk, Chunk** link, Chunk* value)
+{
+#ifdef HEAP_CHECKSUM
+    sumField(&chunkDebug(chunk)->sumOfBytes, link, sizeof(Chunk*), -1);
+    *link = value;
+    sumField(&chunkDebug(chunk)->sumOfBytes, link, sizeof(Chunk*), 1);
+#else
+    *link = value;
+#endif
 }
 
 size_t ceilWord(size_t amount)
@@ -93,861 +725,3328 @@ size_t ceilWord(size_t amount)
     else
         return amount - (amount % sizeof(void*)) + sizeof(void*);
 }
-bool chunkExists(Chunk* chunk)
-
+bool chunkExists(Heap* heap, Chunk* chunk)
 {
     if(chunk == NULL)
         return false;
-    if (heap.isInitialized == false)
+    if (heap->isInitialized == false)
         return false;
-    Chunk* temp = heap.head->next;
-    while(temp != heap.tail)
-    {
-        if(temp == chunk)
-            return true;
-        temp = temp->next;
-    }
-    return false;
+    if(chunk <= heap->head || chunk >= heap->tail)
+        return false;
+    return chunkMapTest(heap, chunk);
 }
-int getSpace(intptr_t countOfPages)
+int getSpace(Heap* heap, intptr_t countOfPages)
 {
     // Overflow
     if (INTPTR_MAX / PAGE_SIZE < countOfPages)
         return -1;
     intptr_t size = countOfPages * PAGE_SIZE;
-    void* space = custom_sbrk(size);
+    // heap is the first member of its arena
+    void* space = arenaSbrk((Arena*)heap, size);
     if(space == (void*)-1)
         return -1;
-    Chunk* oldTail = heap.tail;
+    Chunk* oldTail = heap->tail;
     Chunk* newBoundary = (Chunk*)((uchar*)space+size-sizeof(Chunk));
     newBoundary->size = 0;
     newBoundary->isFree = false;
+    newBoundary->isSlab = false;
+    newBoundary->isQuick = false;
     newBoundary->prev = oldTail;
     newBoundary->next = NULL;
+    newBoundary->nextFree = newBoundary->prevFree = NULL;
     oldTail->next = newBoundary;
     oldTail->size = size - sizeof(Chunk);
-    oldTail->isFree = true;
+    setDebugParams(oldTail, 0, NULL);
     setFences(1, newBoundary);
+    chunkMapSet(heap, newBoundary, true);
+    // The new boundary takes the count of the old one, which was never a used block
+    updateChunksCount(heap, 0, 0, 0, size);
+    oldTail->isFree = true;
+    binInsert(heap, oldTail);
     setSum(2, oldTail, newBoundary);
-    heap.boundaries.rightBound = newBoundary;
-    heap.tail = newBoundary;
-    if(heap.tail->prev->prev->isFree){
-        mergeChunks(heap.tail->prev->prev, heap.tail->prev);
+    heap->boundaries.rightBound = newBoundary;
+    heap->tail = newBoundary;
+    if(heap->tail->prev->prev->isFree){
+        mergeChunks(heap, heap->tail->prev->prev, heap->tail->prev);
     }
-    updateChunksCount();
-    heapSetSum();
+    heapSetSum(heap);
     return 1;
 }
-void splitChunk(Chunk* firstChunk, size_t count)
+void shrinkTail(Heap* heap, intptr_t countOfPages)
+{
+    // Last chunk is free and covers the returned pages
+    Chunk* temp = heap->tail->prev;
+    Chunk* newTail = (Chunk*)((uchar*)heap->tail - countOfPages*PAGE_SIZE);
+    binRemove(heap, temp);
+    chunkMapSet(heap, heap->tail, false);
+    chunkMapSet(heap, newTail, true);
+    if(newTail != temp)
+    {
+        temp->size -= countOfPages*PAGE_SIZE;
+        temp->next = newTail;
+        newTail->prev = temp;
+        binInsert(heap, temp);
+    }
+    newTail->next = NULL;
+    newTail->size = 0;
+    newTail->isFree = false;
+    newTail->isSlab = false;
+    newTail->isQuick = false;
+    newTail->nextFree = newTail->prevFree = NULL;
+    heap->tail = heap->boundaries.rightBound = newTail;
+    setFences(1, heap->tail);
+    setSum(2, heap->tail->prev, heap->tail);
+    updateChunksCount(heap, 0, 0, 0, -countOfPages*PAGE_SIZE);
+    heapSetSum(heap);
+    arenaSbrk((Arena*)heap, -countOfPages*PAGE_SIZE);
+}
+size_t heapTrim(Heap* heap, size_t keep)
 {
+    if(heap->isInitialized == false)
+        return 0;
+    // Parked chunks at the end would hold the pages
+    heapConsolidate(heap);
+    if(heap->tail->prev->isFree == false)
+        return 0;
+    Chunk* last = heap->tail->prev;
+    // The last chunk can go away together with its header
+    size_t span = last->size + sizeof(Chunk);
+    intptr_t pages = keep < span ? (span - keep) / PAGE_SIZE : 0;
+    // Whatever stays of it must hold at least a word
+    if(pages > 0 && pages * PAGE_SIZE != span && pages * PAGE_SIZE > last->size - sizeof(void*))
+        pages--;
+    if(pages <= 0)
+        return 0;
+    shrinkTail(heap, pages);
+    return pages * PAGE_SIZE;
+}
+void splitChunk(Heap* heap, Chunk* firstChunk, size_t count)
+{
+    if(firstChunk->isFree)
+        binRemove(heap, firstChunk);
+    else
+        usedRemove(heap, firstChunk);
     Chunk* secondChunk = (Chunk*)((uchar*)firstChunk + sizeof(Chunk) + count);
     secondChunk->size = firstChunk->size - count - sizeof(Chunk);
     secondChunk->isFree = true;
+    secondChunk->isSlab = false;
+    secondChunk->isQuick = false;
     secondChunk->prev = firstChunk;
     secondChunk->next = firstChunk->next;
-    firstChunk->next->prev = secondChunk;
+    setChunkLink(firstChunk->next, &firstChunk->next->prev, secondChunk);
     firstChunk->next = secondChunk;
     firstChunk->size = count;
     // Update second Chunk
-    secondChunk->debugParams.fileName = NULL;
+    setDebugParams(secondChunk, 0, NULL);
+    chunkMapSet(heap, secondChunk, true);
     setFences(1,secondChunk);
+    if(firstChunk->isFree)
+        binInsert(heap, firstChunk);
+    else
+        usedInsert(heap, firstChunk);
+    binInsert(heap, secondChunk);
     setSum(2, firstChunk, firstChunk->next);
-    if(firstChunk->next->next != NULL)
-        setSum(1, firstChunk->next->next);
 }
-void mergeChunks(Chunk* firstChunk, Chunk* secondChunk)
+void mergeChunks(Heap* heap, Chunk* firstChunk, Chunk* secondChunk)
 {
-    // Merged chunk is Free
-    secondChunk->next->prev = firstChunk;
+    // Second chunk is Free, merged chunk keeps state of the first one
+    binRemove(heap, secondChunk);
+    chunkMapSet(heap, secondChunk, false);
+    if(firstChunk->isFree)
+        binRemove(heap, firstChunk);
+    else
+        usedRemove(heap, firstChunk);
+    setChunkLink(secondChunk->next, &secondChunk->next->prev, firstChunk);
     firstChunk->next = secondChunk->next;
     firstChunk->size += secondChunk->size + sizeof(Chunk);
-    firstChunk->isFree = true;
+    if(firstChunk->isFree)
+        binInsert(heap, firstChunk);
+    else
+        usedInsert(heap, firstChunk);
     setSum(1, firstChunk);
 }
-void updateChunksCount()
+unsigned int binIndex(size_t size)
+{
+    if(size <= SMALL_BIN_LIMIT)
+        return size ? size / sizeof(void*) - 1 : 0;
+    unsigned int index = SMALL_BINS_COUNT + (63 - __builtin_clzll(size)) - (63 - __builtin_clzll(SMALL_BIN_LIMIT));
+    return index < BINS_COUNT ? index : BINS_COUNT - 1;
+}
+unsigned int histogramBucket(size_t size)
+{
+    unsigned int bucket = size ? 63 - __builtin_clzll(size) : 0;
+    return bucket < FREE_HISTOGRAM_BUCKETS ? bucket : FREE_HISTOGRAM_BUCKETS - 1;
+}
+void histogramUpdate(Heap* heap, size_t size, int sign)
+{
+    uint32_t* bucket = &heap->freeHistogram[histogramBucket(size)];
+    sumField(&heap->sumOfBytes, bucket, sizeof(uint32_t), -1);
+    *bucket += sign;
+    sumField(&heap->sumOfBytes, bucket, sizeof(uint32_t), 1);
+}
+void binInsert(Heap* heap, Chunk* chunk)
+{
+    unsigned int index = binIndex(chunk->size);
+    int top = highestBin(heap->binsMap[1]);
+    sumField(&heap->sumOfBytes, &heap->bins[index], sizeof(Chunk*), -1);
+    sumField(&heap->sumOfBytes, &heap->binsMap[index / 64], sizeof(uint64_t), -1);
+    chunk->prevFree = NULL;
+    chunk->nextFree = heap->bins[index];
+    if(chunk->nextFree != NULL)
+        setChunkLink(chunk->nextFree, &chunk->nextFree->prevFree, chunk);
+    heap->bins[index] = chunk;
+    heap->binsMap[index / 64] |= 1ULL << (index % 64);
+    sumField(&heap->sumOfBytes, &heap->bins[index], sizeof(Chunk*), 1);
+    sumField(&heap->sumOfBytes, &heap->binsMap[index / 64], sizeof(uint64_t), 1);
+    updateChunksCount(heap, 1, 0, chunk->size, -(intptr_t)chunk->size);
+    histogramUpdate(heap, chunk->size, 1);
+    if(index >= SMALL_BINS_COUNT && atomic_load_explicit(&placementPolicy, memory_order_relaxed) != placement_segregated)
+        treesUpdate(heap, chunk, true);
+    else if(index >= SMALL_BINS_COUNT)
+        largestInsert(heap, &heap->largestFree, index - SMALL_BINS_COUNT, top, chunk->size);
+    setSum(1, chunk);
+}
+void binRemove(Heap* heap, Chunk* chunk)
+{
+    unsigned int index = binIndex(chunk->size);
+    int top = highestBin(heap->binsMap[1]);
+    sumField(&heap->sumOfBytes, &heap->bins[index], sizeof(Chunk*), -1);
+    sumField(&heap->sumOfBytes, &heap->binsMap[index / 64], sizeof(uint64_t), -1);
+    if(chunk->prevFree != NULL)
+        setChunkLink(chunk->prevFree, &chunk->prevFree->nextFree, chunk->nextFree);
+    else
+        heap->bins[index] = chunk->nextFree;
+    if(chunk->nextFree != NULL)
+        setChunkLink(chunk->nextFree, &chunk->nextFree->prevFree, chunk->prevFree);
+    if(heap->bins[index] == NULL)
+        heap->binsMap[index / 64] &= ~(1ULL << (index % 64));
+    sumField(&heap->sumOfBytes, &heap->bins[index], sizeof(Chunk*), 1);
+    sumField(&heap->sumOfBytes, &heap->binsMap[index / 64], sizeof(uint64_t), 1);
+    updateChunksCount(heap, -1, 0, -(intptr_t)chunk->size, chunk->size);
+    histogramUpdate(heap, chunk->size, -1);
+    if(index >= SMALL_BINS_COUNT && atomic_load_explicit(&placementPolicy, memory_order_relaxed) != placement_segregated)
+        treesUpdate(heap, chunk, false);
+    else if(index >= SMALL_BINS_COUNT)
+        largestRemove(heap, &heap->largestFree, index - SMALL_BINS_COUNT, top, chunk->size);
+    chunk->nextFree = chunk->prevFree = NULL;
+    setSum(1, chunk);
+}
+Chunk* findFreeChunk(Heap* heap, size_t size)
 {
-    uint32_t before = heap.chunksCount.free + heap.chunksCount.used;
-    heap.chunksCount.free = 0;
-    heap.chunksCount.used = 2;
-    Chunk* current = heap.head->next;
-    while(current != heap.tail)
+    unsigned int index = binIndex(size);
+    if(atomic_load_explicit(&placementPolicy, memory_order_relaxed) != placement_segregated)
     {
-        if(current->isFree)
-            heap.chunksCount.free += 1;
-        else
-            heap.chunksCount.used += 1;
-        current = current->next;
+        // Small bins fill the first map word, any of them that fits beats splitting a large chunk
+        uint64_t map = index < SMALL_BINS_COUNT ? heap->binsMap[0] & (~0ULL << index) : 0;
+        if(map)
+            return heap->bins[__builtin_ctzll(map)];
+        return treeFind(heap, size);
     }
-    uint32_t after = heap.chunksCount.used + heap.chunksCount.free;
-    heap.sumOfBytes += (after - before);
-    return;
+    if(index >= SMALL_BINS_COUNT)
+    {
+        // Large bins hold a range of sizes, so only the requested one needs a walk
+        for(Chunk* temp = heap->bins[index]; temp != NULL; temp = temp->nextFree)
+            if(temp->size >= size)
+                return temp;
+        index++;
+    }
+    // Every chunk in a higher bin is big enough
+    for(unsigned int word = index / 64; word < BINS_MAP_WORDS; ++word)
+    {
+        uint64_t map = heap->binsMap[word];
+        if(word == index / 64)
+            map &= ~0ULL << (index % 64);
+        if(map)
+            return heap->bins[word * 64 + __builtin_ctzll(map)];
+    }
+    return NULL;
 }
-
-void* heap_malloc_nts_debug(size_t count, int fileline, const char* filename)
+FreeNode* freeNode(const Chunk* chunk)
 {
-    if(!heap.isInitialized){
-        ConsoleLog(__f, "Heap isn't initialized");
-        return NULL;
+    return (FreeNode*)(chunk + 1);
+}
+uint32_t treePriority(const Chunk* chunk)
+{
+    // Hash of the address, the same chunk always lands in the same place
+    return (uint32_t)(((uint64_t)(uintptr_t)chunk * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+bool treeLess(const Chunk* first, const Chunk* second, int tree)
+{
+    if(tree == TREE_BY_SIZE && first->size != second->size)
+        return first->size < second->size;
+    return first < second;
+}
+void treeUpdate(Chunk* node)
+{
+    FreeNode* free = freeNode(node);
+    free->maxSize = node->size;
+    for(int side = 0; side < 2; ++side)
+    {
+        Chunk* child = free->children[TREE_BY_ADDRESS][side];
+        if(child != NULL && freeNode(child)->maxSize > free->maxSize)
+            free->maxSize = freeNode(child)->maxSize;
     }
-    if(!count)
+}
+void treeSplit(Chunk* node, const Chunk* key, int tree, Chunk** left, Chunk** right)
+{
+    // Nodes before key go left, the rest right
+    if(node == NULL)
     {
-        ConsoleLog(__f, "Invalid count");
-        return NULL;
+        *left = *right = NULL;
+        return;
     }
-    size_t allocateSize = ceilWord(count);
-    Chunk* temp = heap.head->next;
-    while(temp != heap.tail)
+    Chunk** children = freeNode(node)->children[tree];
+    if(treeLess(node, key, tree))
     {
-        if(temp->isFree && temp->size >= allocateSize)
-        {
-            //if(temp->size - allocateSize <= sizeof(Chunk))
-            if(temp->size - allocateSize > sizeof(Chunk))
-                splitChunk(temp, allocateSize);
-            temp->debugParams.fileName = filename;
-            temp->debugParams.lineNumber = fileline;
-            temp->isFree = false;
-            setSum(1, temp);
-            updateChunksCount();
-            return temp+1;
-        }
-        temp = temp->next;
-    }
-    int32_t currentSize = 0;
-    Chunk *previousBlock = heap.tail->prev;
-    if(previousBlock->isFree)
-        currentSize += previousBlock->size;
-    size_t need_bytes = count - currentSize + sizeof(Chunk);
-    intptr_t need_pages = need_bytes / PAGE_SIZE;
-    if(need_bytes % PAGE_SIZE != 0) need_pages++;
-    int err = getSpace(need_pages);
-    if(err == -1) {
-        ConsoleLog(__f, "Couldn't get enough space from OS");
-        return NULL;
+        treeSplit(children[1], key, tree, &children[1], right);
+        *left = node;
+    }
+    else
+    {
+        treeSplit(children[0], key, tree, left, &children[0]);
+        *right = node;
     }
-    Chunk* chunkForReturn;
-    if(heap.tail->prev->prev->isFree)
-        mergeChunks(heap.tail->prev->prev, heap.tail->prev);
-    if(allocateSize - heap.tail->prev->size > sizeof(Chunk)) {
-        splitChunk(heap.tail->prev, allocateSize);
-        heap.tail->prev->prev->debugParams.fileName = filename;
-        heap.tail->prev->prev->debugParams.lineNumber = fileline;
-        heap.tail->prev->prev->isFree = false;
-        setSum(3, heap.tail->prev->prev, heap.tail, heap.tail->prev);
-        chunkForReturn = heap.tail->prev->prev;
-    } else
-    {
-        heap.tail->prev->debugParams.fileName = filename;
-        heap.tail->prev->debugParams.lineNumber = fileline;
-        heap.tail->prev->isFree = false;
-        setSum(2, heap.tail->prev, heap.tail);
-        chunkForReturn = heap.tail->prev;
-    }
-    updateChunksCount();
-    return chunkForReturn+1;
+    if(tree == TREE_BY_ADDRESS)
+        treeUpdate(node);
 }
-void* heap_calloc_nts_debug(size_t number, size_t size, int fileline, const char* filename)
+Chunk* treeMerge(Chunk* left, Chunk* right, int tree)
 {
-    if(SIZE_MAX / size < number){
-        ConsoleLog(__f, "Overflow");
-        return NULL;
+    // Every node of left comes before every node of right
+    if(left == NULL || right == NULL)
+        return left ? left : right;
+    Chunk* root = treePriority(left) > treePriority(right) ? left : right;
+    Chunk** children = freeNode(root)->children[tree];
+    if(root == left)
+        children[1] = treeMerge(children[1], right, tree);
+    else
+        children[0] = treeMerge(left, children[0], tree);
+    if(tree == TREE_BY_ADDRESS)
+        treeUpdate(root);
+    return root;
+}
+Chunk* treeInsert(Chunk* node, Chunk* chunk, int tree)
+{
+    if(node == NULL || treePriority(chunk) > treePriority(node))
+    {
+        Chunk** children = freeNode(chunk)->children[tree];
+        treeSplit(node, chunk, tree, &children[0], &children[1]);
+        if(tree == TREE_BY_ADDRESS)
+            treeUpdate(chunk);
+        return chunk;
     }
-    void* start = heap_malloc_nts_debug(size * number, fileline, filename);
-    if(start == NULL){
-        ConsoleLog(__f, "Couldn't allocate memory");
-        return NULL;
+    Chunk** children = freeNode(node)->children[tree];
+    int side = treeLess(chunk, node, tree) ? 0 : 1;
+    children[side] = treeInsert(children[side], chunk, tree);
+    if(tree == TREE_BY_ADDRESS)
+        treeUpdate(node);
+    return node;
+}
+Chunk* treeRemove(Chunk* node, Chunk* chunk, int tree)
+{
+    // chunk must be in the tree
+    Chunk** children = freeNode(node)->children[tree];
+    if(node == chunk)
+        return treeMerge(children[0], children[1], tree);
+    int side = treeLess(chunk, node, tree) ? 0 : 1;
+    children[side] = treeRemove(children[side], chunk, tree);
+    if(tree == TREE_BY_ADDRESS)
+        treeUpdate(node);
+    return node;
+}
+Chunk* treeBestFit(Chunk* node, size_t size)
+{
+    Chunk* best = NULL;
+    while(node != NULL)
+    {
+        bool fits = (size_t)node->size >= size;
+        if(fits)
+            best = node;
+        node = freeNode(node)->children[TREE_BY_SIZE][fits ? 0 : 1];
     }
-    memset(start, 0, size*number);
-    return start;
+    return best;
 }
-void* heap_realloc_nts_debug(void* memblock, size_t size, int fileline, const char* filename)
+Chunk* treeFirstFit(Chunk* node, size_t size, uintptr_t from)
 {
-    if(heap.isInitialized == false) {
-        ConsoleLog(__f, "Heap doesn't exists");
+    // Lowest address at or past from, subtrees without a big enough chunk are skipped
+    if(node == NULL || freeNode(node)->maxSize < size)
         return NULL;
+    Chunk** children = freeNode(node)->children[TREE_BY_ADDRESS];
+    if((uintptr_t)node >= from)
+    {
+        Chunk* found = treeFirstFit(children[0], size, from);
+        if(found != NULL)
+            return found;
+        if((size_t)node->size >= size)
+            return node;
     }
-    if(!memblock)
-        return heap_malloc_nts_debug(size, fileline, filename);
-    if(size == 0){
-        heap_free_nts(memblock);
-        return NULL;
+    return treeFirstFit(children[1], size, from);
+}
+Chunk* treeFind(Heap* heap, size_t size)
+{
+    int policy = atomic_load_explicit(&placementPolicy, memory_order_relaxed);
+    if(policy == placement_best_fit)
+        return treeBestFit(heap->trees.bySize, size);
+    if(policy == placement_first_fit)
+        return treeFirstFit(heap->trees.byAddress, size, 0);
+    Chunk* found = treeFirstFit(heap->trees.byAddress, size, heap->trees.rover);
+    if(found == NULL)
+        found = treeFirstFit(heap->trees.byAddress, size, 0);
+    if(found != NULL)
+    {
+        sumField(&heap->sumOfBytes, &heap->trees, sizeof(FreeTrees), -1);
+        heap->trees.rover = (uintptr_t)found;
+        sumField(&heap->sumOfBytes, &heap->trees, sizeof(FreeTrees), 1);
     }
-    Chunk* current = (Chunk*)((uchar*)memblock - sizeof(Chunk));
-    size_t amount = ceilWord(size);
-    size_t sizeWithNext = current->size + sizeof(Chunk) + current->next->size;
-    intptr_t left = (intptr_t)sizeWithNext-(intptr_t)amount;
-    if(current->size == amount)
-        {
-            current->debugParams.lineNumber = fileline;
-            current->debugParams.fileName = filename;
-            setSum(1, current);
-            return memblock;
-        }
-    else if(current->size < amount)
+    return found;
+}
+Chunk* treeLast(Chunk* node, int tree)
+{
+    while(node != NULL && freeNode(node)->children[tree][1] != NULL)
+        node = freeNode(node)->children[tree][1];
+    return node;
+}
+void treesUpdate(Heap* heap, Chunk* chunk, bool insert)
+{
+    sumField(&heap->sumOfBytes, &heap->trees, sizeof(FreeTrees), -1);
+    if(insert)
     {
-        if(current->next->isFree && left==0)
+        heap->trees.bySize = treeInsert(heap->trees.bySize, chunk, TREE_BY_SIZE);
+        heap->trees.byAddress = treeInsert(heap->trees.byAddress, chunk, TREE_BY_ADDRESS);
+    }
+    else
+    {
+        heap->trees.bySize = treeRemove(heap->trees.bySize, chunk, TREE_BY_SIZE);
+        heap->trees.byAddress = treeRemove(heap->trees.byAddress, chunk, TREE_BY_ADDRESS);
+    }
+    sumField(&heap->sumOfBytes, &heap->trees, sizeof(FreeTrees), 1);
+}
+int highestBin(uint64_t map)
+{
+    return map ? 63 - __builtin_clzll(map) : -1;
+}
+void largestInsert(Heap* heap, LargestSize* largest, int index, int top, size_t size)
+{
+    // top is the highest large bin before the chunk came in, -1 when there was none
+    if(index < top || (index == top && (largest->isStale || size < largest->size)))
+        return;
+    sumField(&heap->sumOfBytes, largest, sizeof(LargestSize), -1);
+    if(index == top && size == largest->size)
+        largest->count++;
+    else
+    {
+        largest->size = size;
+        largest->count = 1;
+        largest->isStale = false;
+    }
+    sumField(&heap->sumOfBytes, largest, sizeof(LargestSize), 1);
+}
+void largestRemove(Heap* heap, LargestSize* largest, int index, int top, size_t size)
+{
+    if(index != top || largest->isStale || size != largest->size)
+        return;
+    sumField(&heap->sumOfBytes, largest, sizeof(LargestSize), -1);
+    if(--largest->count == 0)
+        largest->isStale = true;
+    sumField(&heap->sumOfBytes, largest, sizeof(LargestSize), 1);
+}
+size_t largestOf(const LargestSize* largest, int top, size_t limit)
+{
+    // top is the highest non-empty large bin, a stale size gives way to its upper bound
+    if(!largest->isStale)
+        return largest->size;
+    size_t bound = ((size_t)SMALL_BIN_LIMIT << (top + 1)) - sizeof(void*);
+    return bound < limit ? bound : limit;
+}
+void usedInsert(Heap* heap, Chunk* chunk)
+{
+    // chunk has just become a used block, or got its new size as one
+    unsigned int index = binIndex(chunk->size);
+    uint32_t* count = index < SMALL_BINS_COUNT ? &heap->usedSizes.small[index] : &heap->usedSizes.large[index - SMALL_BINS_COUNT];
+    uint64_t* map = index < SMALL_BINS_COUNT ? &heap->usedSizes.smallMap : &heap->usedSizes.largeMap;
+    int top = highestBin(heap->usedSizes.largeMap);
+    sumField(&heap->sumOfBytes, count, sizeof(uint32_t), -1);
+    sumField(&heap->sumOfBytes, map, sizeof(uint64_t), -1);
+    (*count)++;
+    *map |= 1ULL << (index % 64);
+    sumField(&heap->sumOfBytes, count, sizeof(uint32_t), 1);
+    sumField(&heap->sumOfBytes, map, sizeof(uint64_t), 1);
+    if(index < SMALL_BINS_COUNT)
+        return;
+    size_t* bytes = &heap->usedSizes.largeBytes[index - SMALL_BINS_COUNT];
+    sumField(&heap->sumOfBytes, bytes, sizeof(size_t), -1);
+    *bytes += chunk->size;
+    sumField(&heap->sumOfBytes, bytes, sizeof(size_t), 1);
+    largestInsert(heap, &heap->usedSizes.largest, index - SMALL_BINS_COUNT, top, chunk->size);
+}
+void usedRemove(Heap* heap, Chunk* chunk)
+{
+    // Before chunk stops being a used block or its size changes
+    unsigned int index = binIndex(chunk->size);
+    uint32_t* count = index < SMALL_BINS_COUNT ? &heap->usedSizes.small[index] : &heap->usedSizes.large[index - SMALL_BINS_COUNT];
+    uint64_t* map = index < SMALL_BINS_COUNT ? &heap->usedSizes.smallMap : &heap->usedSizes.largeMap;
+    int top = highestBin(heap->usedSizes.largeMap);
+    sumField(&heap->sumOfBytes, count, sizeof(uint32_t), -1);
+    sumField(&heap->sumOfBytes, map, sizeof(uint64_t), -1);
+    if(--(*count) == 0)
+        *map &= ~(1ULL << (index % 64));
+    sumField(&heap->sumOfBytes, count, sizeof(uint32_t), 1);
+    sumField(&heap->sumOfBytes, map, sizeof(uint64_t), 1);
+    if(index < SMALL_BINS_COUNT)
+        return;
+    size_t* bytes = &heap->usedSizes.largeBytes[index - SMALL_BINS_COUNT];
+    sumField(&heap->sumOfBytes, bytes, sizeof(size_t), -1);
+    *bytes -= chunk->size;
+    sumField(&heap->sumOfBytes, bytes, sizeof(size_t), 1);
+    largestRemove(heap, &heap->usedSizes.largest, index - SMALL_BINS_COUNT, top, chunk->size);
+}
+int usedSizesValidate(Heap* heap, const uint32_t* usedSmall, const uint32_t* usedLarge, const size_t* usedLargeBytes)
+{
+    // Counts come from the chunk walk
+    for(unsigned int index = 0; index < SMALL_BINS_COUNT; ++index)
+    {
+        if(usedSmall[index] != heap->usedSizes.small[index] || (usedSmall[index] != 0) != ((heap->usedSizes.smallMap >> index) & 1))
+        {
+            return printf("%s : Used sizes[%u] don't match used chunks\n", __f, index), -1;
+        }
+    }
+    for(unsigned int index = 0; index < LARGE_BINS_COUNT; ++index)
+    {
+        if(usedLarge[index] != heap->usedSizes.large[index] || usedLargeBytes[index] != heap->usedSizes.largeBytes[index] ||
+           (usedLarge[index] != 0) != ((heap->usedSizes.largeMap >> index) & 1))
+        {
+            return printf("%s : Used bin[%u] doesn't match used chunks\n", __f, index), -1;
+        }
+    }
+    return 0;
+}
+int largestValidate(const LargestSize* largest, size_t max, uint32_t count)
+{
+    // max and count describe the highest non-empty bin, a size that isn't stale must match them
+    return largest->isStale || (largest->size == max && largest->count == count) ? 0 : -1;
+}
+int64_t treeValidate(Heap* heap, Chunk* node, int tree, const Chunk* low, const Chunk* high)
+{
+    // Number of nodes, -1 when order, priorities or sizes are broken
+    if(node == NULL)
+        return 0;
+    if(!chunkExists(heap, node) || !node->isFree || binIndex(node->size) < SMALL_BINS_COUNT)
+        return -1;
+    if((low != NULL && !treeLess(low, node, tree)) || (high != NULL && !treeLess(node, high, tree)))
+        return -1;
+    Chunk** children = freeNode(node)->children[tree];
+    for(int side = 0; side < 2; ++side)
+        if(children[side] != NULL && treePriority(children[side]) > treePriority(node))
+            return -1;
+    int64_t left = treeValidate(heap, children[0], tree, low, node);
+    int64_t right = treeValidate(heap, children[1], tree, node, high);
+    if(left < 0 || right < 0)
+        return -1;
+    if(tree == TREE_BY_ADDRESS)
+    {
+        size_t maxSize = node->size;
+        for(int side = 0; side < 2; ++side)
+            if(children[side] != NULL && freeNode(children[side])->maxSize > maxSize)
+                maxSize = freeNode(children[side])->maxSize;
+        if(freeNode(node)->maxSize != maxSize)
+            return -1;
+    }
+    return left + right + 1;
+}
+void setChunkUsed(Heap* heap, Chunk* chunk)
+{
+    if(chunk->isFree)
+    {
+        binRemove(heap, chunk);
+        updateChunksCount(heap, 0, 1, 0, 0);
+        chunk->isFree = false;
+        usedInsert(heap, chunk);
+    }
+    setSum(1, chunk);
+}
+void setChunkFree(Heap* heap, Chunk* chunk)
+{
+    usedRemove(heap, chunk);
+    updateChunksCount(heap, 0, -1, 0, 0);
+    chunk->isFree = true;
+    binInsert(heap, chunk);
+}
+void quickPush(Heap* heap, Chunk* chunk)
+{
+    // Neighbours aren't touched, the chunk stays used to them until heapConsolidate
+    Chunk** list = &heap->quick.lists[chunk->size / sizeof(void*) - 1];
+    usedRemove(heap, chunk);
+    sumField(&heap->sumOfBytes, list, sizeof(Chunk*), -1);
+    sumField(&heap->sumOfBytes, &heap->quick.bytes, sizeof(size_t), -1);
+    chunk->isQuick = true;
+    chunk->nextFree = *list;
+    *list = chunk;
+    heap->quick.bytes += chunk->size;
+    sumField(&heap->sumOfBytes, list, sizeof(Chunk*), 1);
+    sumField(&heap->sumOfBytes, &heap->quick.bytes, sizeof(size_t), 1);
+    updateChunksCount(heap, 1, -1, chunk->size, -(intptr_t)chunk->size);
+    histogramUpdate(heap, chunk->size, 1);
+    setSum(1, chunk);
+}
+Chunk* quickPop(Heap* heap, size_t size)
+{
+    Chunk** list = &heap->quick.lists[size / sizeof(void*) - 1];
+    Chunk* chunk = *list;
+    if(chunk == NULL)
+        return NULL;
+    sumField(&heap->sumOfBytes, list, sizeof(Chunk*), -1);
+    sumField(&heap->sumOfBytes, &heap->quick.bytes, sizeof(size_t), -1);
+    *list = chunk->nextFree;
+    heap->quick.bytes -= chunk->size;
+    sumField(&heap->sumOfBytes, list, sizeof(Chunk*), 1);
+    sumField(&heap->sumOfBytes, &heap->quick.bytes, sizeof(size_t), 1);
+    chunk->isQuick = false;
+    chunk->nextFree = NULL;
+    updateChunksCount(heap, -1, 1, -(intptr_t)chunk->size, chunk->size);
+    histogramUpdate(heap, chunk->size, -1);
+    usedInsert(heap, chunk);
+    setSum(1, chunk);
+    return chunk;
+}
+void heapConsolidate(Heap* heap)
+{
+    if(heap->quick.bytes == 0)
+        return;
+    // Lists are relinked by run start first, a run's inner headers become data once it's merged
+    Chunk* starts = NULL;
+    sumField(&heap->sumOfBytes, &heap->quick, sizeof(QuickLists), -1);
+    for(unsigned int index = 0; index < QUICK_LISTS_COUNT; ++index)
+    {
+        Chunk* chunk = heap->quick.lists[index];
+        heap->quick.lists[index] = NULL;
+        while(chunk != NULL)
+        {
+            Chunk* next = chunk->nextFree;
+            if(!chunk->prev->isQuick)
+            {
+                chunk->nextFree = starts;
+                starts = chunk;
+            }
+            chunk = next;
+        }
+    }
+    heap->quick.bytes = 0;
+    sumField(&heap->sumOfBytes, &heap->quick, sizeof(QuickLists), 1);
+    while(starts != NULL)
+    {
+        // Neighbouring parked chunks go back as one free chunk, merged in address order
+        Chunk* first = starts;
+        starts = first->nextFree;
+        Chunk* last = first;
+        histogramUpdate(heap, first->size, -1);
+        size_t parkedBytes = first->size;
+        int32_t runLength = 1;
+        while(last->next->isQuick)
+        {
+            last = last->next;
+            histogramUpdate(heap, last->size, -1);
+            parkedBytes += last->size;
+            chunkMapSet(heap, last, false);
+            runLength++;
+        }
+        updateChunksCount(heap, -runLength, 0, -(intptr_t)parkedBytes, parkedBytes);
+        first->size = (uchar*)last + sizeof(Chunk) + last->size - (uchar*)(first + 1);
+        first->next = last->next;
+        setChunkLink(last->next, &last->next->prev, first);
+        first->isQuick = false;
+        first->isFree = true;
+        binInsert(heap, first);
+        if(first->next->isFree)
+            mergeChunks(heap, first, first->next);
+        if(first->prev->isFree)
+            mergeChunks(heap, first->prev, first);
+    }
+}
+int chunkMapSetup(Heap* heap, size_t span)
+{
+    // Both maps share one lazily backed mapping
+    size_t size = span / sizeof(void*) / CHAR_BIT + span / PAGE_SIZE / CHAR_BIT;
+    if(size % PAGE_SIZE != 0)
+        size += PAGE_SIZE - size % PAGE_SIZE;
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(map == MAP_FAILED)
+        return -1;
+    heap->chunkMap = map;
+    heap->pageMap = heap->chunkMap + span / sizeof(void*) / 64;
+    heap->mapSpan = size;
+    return 0;
+}
+void chunkMapSet(Heap* heap, Chunk* chunk, bool isStart)
+{
+    // Arena is the owner of heap and its base is where the map starts
+    uintptr_t offset = (uintptr_t)chunk - (uintptr_t)((Arena*)heap)->base;
+    uintptr_t word = offset / sizeof(void*);
+    uintptr_t page = offset / PAGE_SIZE;
+    // Atomic because thread caches test chunk bits without the arena lock
+    if(isStart)
+    {
+        __atomic_fetch_or(&heap->chunkMap[word / 64], 1ULL << (word % 64), __ATOMIC_RELAXED);
+        heap->pageMap[page / 64] |= 1ULL << (page % 64);
+        return;
+    }
+    __atomic_fetch_and(&heap->chunkMap[word / 64], ~(1ULL << (word % 64)), __ATOMIC_RELAXED);
+    uint64_t* pageWords = heap->chunkMap + page * (PAGE_SIZE / sizeof(void*) / 64);
+    for(unsigned int i = 0; i < PAGE_SIZE / sizeof(void*) / 64; ++i)
+        if(pageWords[i])
+            return;
+    heap->pageMap[page / 64] &= ~(1ULL << (page % 64));
+}
+bool chunkMapTest(Heap* heap, const void* pointer)
+{
+    uintptr_t offset = (uintptr_t)pointer - (uintptr_t)((Arena*)heap)->base;
+    if(offset % sizeof(void*) != 0)
+        return false;
+    uintptr_t word = offset / sizeof(void*);
+    return (__atomic_load_n(&heap->chunkMap[word / 64], __ATOMIC_RELAXED) & (1ULL << (word % 64))) != 0;
+}
+Chunk* chunkMapFind(Heap* heap, const void* pointer)
+{
+    // Last chunk starting at or before pointer, pointer must lie inside the heap
+    uintptr_t base = (uintptr_t)((Arena*)heap)->base;
+    uintptr_t word = ((uintptr_t)pointer - base) / sizeof(void*);
+    uintptr_t page = word / (PAGE_SIZE / sizeof(void*));
+    uintptr_t pageFirst = page * (PAGE_SIZE / sizeof(void*) / 64);
+    uint64_t bits = heap->chunkMap[word / 64] & (~0ULL >> (63 - word % 64));
+    for(uintptr_t index = word / 64; ; bits = heap->chunkMap[--index])
+    {
+        if(bits)
+            return (Chunk*)(base + (index * 64 + 63 - __builtin_clzll(bits)) * sizeof(void*));
+        if(index == pageFirst)
+            break;
+    }
+    // Nothing earlier in this page, so the chunk starts in the closest marked page before it
+    for(uintptr_t index = page / 64; ; --index)
+    {
+        bits = heap->pageMap[index];
+        if(index == page / 64)
+            bits &= (1ULL << (page % 64)) - 1;
+        if(bits)
+        {
+            page = index * 64 + 63 - __builtin_clzll(bits);
+            break;
+        }
+        if(index == 0)
+            return NULL;
+    }
+    for(uintptr_t index = (page + 1) * (PAGE_SIZE / sizeof(void*) / 64) - 1; ; --index)
+        if(heap->chunkMap[index])
+            return (Chunk*)(base + (index * 64 + 63 - __builtin_clzll(heap->chunkMap[index])) * sizeof(void*));
+}
+void slabLink(Heap* heap, Slab* slab)
+{
+    unsigned int index = slab->slotSize / sizeof(void*) - 1;
+    sumField(&heap->sumOfBytes, &heap->slabs[index], sizeof(Slab*), -1);
+    slab->prev = NULL;
+    slab->next = heap->slabs[index];
+    if(slab->next != NULL)
+        slab->next->prev = slab;
+    heap->slabs[index] = slab;
+    sumField(&heap->sumOfBytes, &heap->slabs[index], sizeof(Slab*), 1);
+}
+void slabUnlink(Heap* heap, Slab* slab)
+{
+    unsigned int index = slab->slotSize / sizeof(void*) - 1;
+    sumField(&heap->sumOfBytes, &heap->slabs[index], sizeof(Slab*), -1);
+    if(slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        heap->slabs[index] = slab->next;
+    if(slab->next != NULL)
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+    sumField(&heap->sumOfBytes, &heap->slabs[index], sizeof(Slab*), 1);
+}
+Slab* slabOf(Heap* heap, const void* pointer)
+{
+    if(heap->isInitialized == false || (Chunk*)pointer <= heap->head || (Chunk*)pointer >= heap->tail)
+        return NULL;
+    Chunk* chunk = chunkMapFind(heap, pointer);
+    if(chunk->isFree || !chunk->isSlab)
+        return NULL;
+    return (Slab*)(chunk + 1);
+}
+void* slabMalloc(Heap* heap, size_t size)
+{
+    unsigned int index = size / sizeof(void*) - 1;
+    Slab* slab = heap->slabs[index];
+    if(slab == NULL)
+    {
+        void* memory = heapMallocChunk(heap, SLAB_SIZE - sizeof(Chunk), 0, NULL);
+        if(memory == NULL)
+            return NULL;
+        Chunk* chunk = (Chunk*)memory - 1;
+        chunk->isSlab = true;
+        setSum(1, chunk);
+        slab = memory;
+        slab->firstFence = slab->secondFence = RANDOM_FENCE_VALUE;
+        slab->slotSize = size;
+        slab->slotsCount = (chunk->size - sizeof(Slab)) / size;
+        if(slab->slotsCount > SLAB_MAP_WORDS * 64)
+            slab->slotsCount = SLAB_MAP_WORDS * 64;
+        slab->usedCount = 0;
+        memset(slab->usedMap, 0, sizeof(slab->usedMap));
+        slabLink(heap, slab);
+    }
+    // Linked slabs always have a clear bit below slotsCount
+    unsigned int word = 0;
+    while(slab->usedMap[word] == ~0ULL)
+        word++;
+    unsigned int slot = word * 64 + __builtin_ctzll(~slab->usedMap[word]);
+    slab->usedMap[word] |= 1ULL << (slot % 64);
+    if(++slab->usedCount == slab->slotsCount)
+        slabUnlink(heap, slab);
+    return (uchar*)(slab + 1) + slot * slab->slotSize;
+}
+void slabFree(Heap* heap, Slab* slab, void* memblock)
+{
+    if((uchar*)memblock < (uchar*)(slab + 1))
+    {
+        ConsoleLog(__f, "Invalid chunk <not exists>");
+        return;
+    }
+    uintptr_t offset = (uchar*)memblock - (uchar*)(slab + 1);
+    unsigned int slot = offset / slab->slotSize;
+    if(offset % slab->slotSize != 0 || slot >= slab->slotsCount)
+    {
+        ConsoleLog(__f, "Invalid chunk <not exists>");
+        return;
+    }
+    if((slab->usedMap[slot / 64] & (1ULL << (slot % 64))) == 0)
+    {
+        ConsoleLog(__f, "Double free deteched");
+        return;
+    }
+    slab->usedMap[slot / 64] &= ~(1ULL << (slot % 64));
+    if(slab->usedCount-- == slab->slotsCount)
+        slabLink(heap, slab);
+    // Empty slabs go back to the heap unless it's the last one of its class
+    if(slab->usedCount != 0 || (heap->slabs[slab->slotSize / sizeof(void*) - 1] == slab && slab->next == NULL))
+        return;
+    slabUnlink(heap, slab);
+    Chunk* chunk = (Chunk*)slab - 1;
+    chunk->isSlab = false;
+    setSum(1, chunk);
+    heapFree(heap, slab);
+}
+void* slabRealloc(Heap* heap, Slab* slab, void* memblock, size_t size, size_t alignment, int fileline, const char* filename)
+{
+    // Alignment 0 means a plain realloc
+    bool aligned = alignment == 0 || (uintptr_t)memblock % alignment == 0;
+    if(aligned && ceilWord(size) == slab->slotSize)
+        return memblock;
+    void* memory = alignment ? heapMallocAligned(heap, size, alignment, fileline, filename) : heapMalloc(heap, size, fileline, filename);
+    if(memory == NULL)
+        return NULL;
+    memcpy(memory, memblock, size < slab->slotSize ? size : slab->slotSize);
+    slabFree(heap, slab, memblock);
+    return memory;
+}
+int slabValidate(Heap* heap, Chunk* chunk)
+{
+    Slab* slab = (Slab*)(chunk + 1);
+    if(slab->firstFence != RANDOM_FENCE_VALUE || slab->secondFence != RANDOM_FENCE_VALUE)
+        return -1;
+    if(slab->slotSize == 0 || slab->slotSize % sizeof(void*) != 0 || slab->slotSize > SLAB_MAX_SIZE)
+        return -1;
+    if(slab->slotsCount > SLAB_MAP_WORDS * 64 || sizeof(Slab) + (size_t)slab->slotsCount * slab->slotSize > chunk->size)
+        return -1;
+    uint32_t used = 0;
+    for(unsigned int word = 0; word < SLAB_MAP_WORDS; ++word)
+        used += __builtin_popcountll(slab->usedMap[word]);
+    if(used != slab->usedCount || (slab->slotsCount < SLAB_MAP_WORDS * 64 && slab->usedMap[slab->slotsCount / 64] >> (slab->slotsCount % 64) != 0))
+        return -1;
+    // Only slabs with free slots are linked
+    bool linked = slab->prev != NULL || heap->slabs[slab->slotSize / sizeof(void*) - 1] == slab;
+    if(linked != (slab->usedCount < slab->slotsCount))
+        return -1;
+    return 0;
+}
+LargeBlock* largeBlockFind(const void* pointer)
+{
+    // Caller holds largeBlocksMutex, finds the block whose mapping holds pointer
+    size_t left = 0, right = largeBlocksCount;
+    while(left < right)
+    {
+        size_t middle = left + (right - left) / 2;
+        if((uint8_t*)pointer < largeBlocks[middle].memory)
+            right = middle;
+        else if((uint8_t*)pointer >= largeBlocks[middle].memory + largeBlocks[middle].mapped)
+            left = middle + 1;
+        else
+            return &largeBlocks[middle];
+    }
+    return NULL;
+}
+bool largeBlockInsert(uint8_t* memory, size_t mapped, size_t size)
+{
+    // Caller holds largeBlocksMutex, the table lives in its own mapping
+    if(largeBlocksCount == largeBlocksCapacity)
+    {
+        size_t oldSize = largeBlocksCapacity * sizeof(LargeBlock);
+        size_t newSize = oldSize ? oldSize * 2 : PAGE_SIZE;
+        void* table = oldSize ? mremap(largeBlocks, oldSize, newSize, MREMAP_MAYMOVE) : mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(table == MAP_FAILED)
+            return false;
+        largeBlocks = table;
+        largeBlocksCapacity = newSize / sizeof(LargeBlock);
+    }
+    size_t index = 0;
+    while(index < largeBlocksCount && largeBlocks[index].memory < memory)
+        index++;
+    memmove(&largeBlocks[index + 1], &largeBlocks[index], (largeBlocksCount - index) * sizeof(LargeBlock));
+    largeBlocks[index].memory = memory;
+    largeBlocks[index].mapped = mapped;
+    largeBlocks[index].size = size;
+    largeBlocksCount++;
+    largeBlocksUpdate(mapped, 1, 0, size);
+    return true;
+}
+void largeBlockRemove(LargeBlock* block)
+{
+    // Caller holds largeBlocksMutex
+    size_t mapped = block->mapped;
+    size_t size = block->size;
+    memmove(block, block + 1, (largeBlocks + largeBlocksCount - block - 1) * sizeof(LargeBlock));
+    largeBlocksCount--;
+    largeBlocksUpdate(-(intptr_t)mapped, -1, size, 0);
+}
+void largeBlocksUpdate(intptr_t mapped, int64_t blocks, size_t oldSize, size_t newSize)
+{
+    // Caller holds largeBlocksMutex. The table is only looked through again when its largest block
+    // leaves or shrinks, which costs no more than the memmove that comes with it
+    largeTotals.usedBytes += mapped;
+    largeTotals.usedChunks += blocks;
+    if(newSize > largeTotals.largestUsed)
+        largeTotals.largestUsed = newSize;
+    else if(oldSize == largeTotals.largestUsed && newSize < oldSize)
+    {
+        largeTotals.largestUsed = 0;
+        for(size_t i = 0; i < largeBlocksCount; ++i)
+            if(largeBlocks[i].size > largeTotals.largestUsed)
+                largeTotals.largestUsed = largeBlocks[i].size;
+    }
+    statsStore(&largeStats, &largeTotals);
+}
+void* largeMalloc(size_t size, size_t alignment)
+{
+    size_t mapped = size;
+    if(mapped % PAGE_SIZE != 0)
+        mapped += PAGE_SIZE - mapped % PAGE_SIZE;
+    // Mappings are page aligned, anything stricter is cut out of a bigger one
+    size_t padding = alignment > PAGE_SIZE ? alignment - PAGE_SIZE : 0;
+    if(mapped > SIZE_MAX - padding)
+    {
+        ConsoleLog(__f, "Couldn't get enough space from OS");
+        return NULL;
+    }
+    uint8_t* memory = mmap(NULL, mapped + padding, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED)
+    {
+        ConsoleLog(__f, "Couldn't get enough space from OS");
+        return NULL;
+    }
+    if(padding != 0)
+    {
+        size_t lead = (alignment - (uintptr_t)memory % alignment) % alignment;
+        if(lead != 0)
+            munmap(memory, lead);
+        if(padding - lead != 0)
+            munmap(memory + lead + mapped, padding - lead);
+        memory += lead;
+    }
+    pthread_mutex_lock(&largeBlocksMutex);
+    bool inserted = largeBlockInsert(memory, mapped, size);
+    pthread_mutex_unlock(&largeBlocksMutex);
+    if(!inserted)
+    {
+        munmap(memory, mapped);
+        ConsoleLog(__f, "Couldn't grow large blocks table");
+        return NULL;
+    }
+    statsOsBytes(mapped);
+    return memory;
+}
+bool largeFree(void* memblock, size_t size)
+{
+    // Size 0 means no hint, with chunk debugging a hint is checked under the same hold
+    pthread_mutex_lock(&largeBlocksMutex);
+    LargeBlock* block = largeBlockFind(memblock);
+    if(block == NULL || block->memory != memblock)
+        return pthread_mutex_unlock(&largeBlocksMutex), false;
+#ifdef HEAP_CHUNK_DEBUG
+    if(size != 0 && block->size != ceilWord(size))
+        printf("%s : Mapping of %zu bytes freed as %zu bytes\n", __f, block->size, size);
+#endif
+    uint8_t* memory = block->memory;
+    size_t mapped = block->mapped;
+    largeBlockRemove(block);
+    pthread_mutex_unlock(&largeBlocksMutex);
+    munmap(memory, mapped);
+    statsOsBytes(-(intptr_t)mapped);
+    return true;
+}
+void* largeRealloc(Heap* heap, void* memblock, size_t size, size_t alignment, int fileline, const char* filename)
+{
+    size_t amount = ceilWord(size);
+    size_t threshold = atomic_load_explicit(&mmapThreshold, memory_order_relaxed);
+    pthread_mutex_lock(&largeBlocksMutex);
+    LargeBlock* block = largeBlockFind(memblock);
+    size_t oldSize = block->size;
+    // Alignment 0 means a plain realloc
+    bool aligned = alignment == 0 || (uintptr_t)memblock % alignment == 0;
+    if(threshold != 0 && amount >= threshold && aligned)
+    {
+        size_t mapped = amount;
+        if(mapped % PAGE_SIZE != 0)
+            mapped += PAGE_SIZE - mapped % PAGE_SIZE;
+        uint8_t* memory = block->memory;
+        if(mapped != block->mapped)
+        {
+            // The kernel moves the pages, nothing gets copied; a moved mapping is only page aligned
+            memory = mremap(block->memory, block->mapped, mapped, alignment <= PAGE_SIZE ? MREMAP_MAYMOVE : 0);
+            if(memory == MAP_FAILED && alignment <= PAGE_SIZE)
+            {
+                pthread_mutex_unlock(&largeBlocksMutex);
+                ConsoleLog(__f, "Couldn't get enough space from OS");
+                return NULL;
+            }
+        }
+        if(memory != MAP_FAILED)
+        {
+            statsOsBytes((intptr_t)mapped - (intptr_t)block->mapped);
+            if(memory != block->memory)
+            {
+                largeBlockRemove(block);
+                largeBlockInsert(memory, mapped, amount);
+            }
+            else
+            {
+                size_t oldMapped = block->mapped;
+                block->mapped = mapped;
+                block->size = amount;
+                largeBlocksUpdate((intptr_t)mapped - (intptr_t)oldMapped, 0, oldSize, amount);
+            }
+            pthread_mutex_unlock(&largeBlocksMutex);
+            return memory;
+        }
+        // Couldn't grow in place, the block moves to a new aligned mapping below
+    }
+    pthread_mutex_unlock(&largeBlocksMutex);
+    // Small enough to live in the heap again, or has to move for its alignment
+    void* memory = alignment ? heapMallocAligned(heap, size, alignment, fileline, filename) : heapMalloc(heap, size, fileline, filename);
+    if(memory == NULL)
+        return NULL;
+    memcpy(memory, memblock, amount < oldSize ? amount : oldSize);
+    largeFree(memblock, 0);
+    return memory;
+}
+size_t largeBlockSize(const void* memblock)
+{
+    pthread_mutex_lock(&largeBlocksMutex);
+    LargeBlock* block = largeBlockFind(memblock);
+    size_t size = (block != NULL && block->memory == memblock) ? block->size : 0;
+    pthread_mutex_unlock(&largeBlocksMutex);
+    return size;
+}
+void* largeBlockStart(const void* pointer)
+{
+    // One lookup under the lock, a concurrent free can't pull the block away in between
+    pthread_mutex_lock(&largeBlocksMutex);
+    LargeBlock* block = largeBlockFind(pointer);
+    void* memory = (block != NULL && (size_t)((uint8_t*)pointer - block->memory) < block->size) ? block->memory : NULL;
+    pthread_mutex_unlock(&largeBlocksMutex);
+    return memory;
+}
+enum pointer_type_t largePointerType(const void* pointer)
+{
+    enum pointer_type_t type = pointer_out_of_heap;
+    pthread_mutex_lock(&largeBlocksMutex);
+    LargeBlock* block = largeBlockFind(pointer);
+    if(block != NULL)
+    {
+        size_t offset = (uint8_t*)pointer - block->memory;
+        if(offset >= block->size)
+            type = pointer_unallocated;
+        else
+            type = (offset == 0) ? pointer_valid : pointer_inside_data_block;
+    }
+    pthread_mutex_unlock(&largeBlocksMutex);
+    return type;
+}
+void largeBlocksUsage(size_t* bytes, uint64_t* blocks, size_t* largest)
+{
+    // Lock-free, the three totals come from one store
+    ArenaStats stats;
+    statsRead(&largeStats, &stats);
+    *bytes = stats.usedBytes;
+    *blocks = stats.usedChunks;
+    *largest = stats.largestUsed;
+}
+int largeBlocksValidate(void)
+{
+    // Caller holds largeBlocksMutex
+    size_t mapped = 0, largest = 0;
+    for(size_t i = 0; i < largeBlocksCount; ++i)
+    {
+        LargeBlock* block = &largeBlocks[i];
+        if((uintptr_t)block->memory % PAGE_SIZE != 0 || block->mapped % PAGE_SIZE != 0 || block->size > block->mapped)
+            return printf("%s : Large block[%zu] is damaged\n", __f, i), -1;
+        if(i > 0 && block->memory < largeBlocks[i - 1].memory + largeBlocks[i - 1].mapped)
+            return printf("%s : Large block[%zu] overlaps the previous one\n", __f, i), -1;
+        mapped += block->mapped;
+        if(block->size > largest)
+            largest = block->size;
+    }
+    if(mapped != largeTotals.usedBytes || largeBlocksCount != largeTotals.usedChunks || largest != largeTotals.largestUsed)
+        return ConsoleLog(__f, "Large block totals don't match the table"), -1;
+    return 0;
+}
+uint64_t profileNow(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+size_t profileHash(const void* pointer, size_t size)
+{
+    // size is a power of two, the middle bits of the product mix the whole address
+    uint64_t hash = (uint64_t)(uintptr_t)pointer * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(hash >> 32) & (size - 1);
+}
+ProfileSite* profileSiteOf(const char* fileName, int32_t lineNumber)
+{
+    // Caller holds profileMutex
+    size_t index = profileHash(fileName, PROFILE_SITES) ^ (lineNumber & (PROFILE_SITES - 1));
+    for(size_t probe = 0; probe < PROFILE_SITES; ++probe)
+    {
+        ProfileSite* site = &profileSites[(index + probe) & (PROFILE_SITES - 1)];
+        if(!site->isUsed)
+        {
+            site->isUsed = true;
+            site->fileName = fileName;
+            site->lineNumber = lineNumber;
+            return site;
+        }
+        if(site->fileName == fileName && site->lineNumber == lineNumber)
+            return site;
+    }
+    return NULL;
+}
+void profileMalloc(const void* memblock, size_t size, int fileline, const char* filename)
+{
+    // Unsampled calls only count down a thread-local byte budget
+    size_t rate = atomic_load_explicit(&profileRate, memory_order_relaxed);
+    if(rate == 0 || memblock == NULL || size == 0)
+        return;
+    profileBytesLeft -= size < INTPTR_MAX ? (intptr_t)size : INTPTR_MAX;
+    if(profileBytesLeft > 0)
+        return;
+    // Random intervals averaging rate bytes keep periodic patterns from aliasing with it
+    if(profileRandom == 0)
+        profileRandom = (uintptr_t)&profileRandom;
+    profileRandom = profileRandom * 6364136223846793005ULL + 1442695040888963407ULL;
+    profileBytesLeft = 1 + (profileRandom >> 33) % (2 * rate);
+    size_t weight = size < rate ? rate : size;
+    uint64_t start = profileNow();
+    pthread_mutex_lock(&profileMutex);
+    ProfileSite* site = profileSiteOf(filename, fileline);
+    ProfileSample* sample = profileFreeSamples;
+    if(sample != NULL)
+        profileFreeSamples = sample->next;
+    else if(profileSamplesUsed < PROFILE_SAMPLES)
+        sample = &profileSamples[profileSamplesUsed++];
+    if(site == NULL || sample == NULL)
+    {
+        // Tables are full, the sample is dropped
+        if(sample != NULL)
+        {
+            sample->next = profileFreeSamples;
+            profileFreeSamples = sample;
+        }
+        pthread_mutex_unlock(&profileMutex);
+        return;
+    }
+    sample->memblock = memblock;
+    sample->site = site;
+    sample->weight = weight;
+    sample->count = weight / size;
+    sample->start = start;
+    size_t bucket = profileHash(memblock, PROFILE_SAMPLES);
+    sample->next = profileBuckets[bucket];
+    profileBuckets[bucket] = sample;
+    atomic_fetch_add_explicit(&profileFilter[profileHash(memblock, PROFILE_FILTER_SIZE)], 1, memory_order_relaxed);
+    site->liveBytes += weight;
+    site->allocations += sample->count;
+    site->allocatedBytes += weight;
+    pthread_mutex_unlock(&profileMutex);
+}
+void profileFree(const void* memblock)
+{
+    // The filter keeps frees of unsampled blocks away from the lock
+    if(memblock == NULL || atomic_load_explicit(&profileFilter[profileHash(memblock, PROFILE_FILTER_SIZE)], memory_order_relaxed) == 0)
+        return;
+    uint64_t end = profileNow();
+    pthread_mutex_lock(&profileMutex);
+    ProfileSample** link = &profileBuckets[profileHash(memblock, PROFILE_SAMPLES)];
+    while(*link != NULL && (*link)->memblock != memblock)
+        link = &(*link)->next;
+    ProfileSample* sample = *link;
+    if(sample != NULL)
+    {
+        *link = sample->next;
+        atomic_fetch_sub_explicit(&profileFilter[profileHash(memblock, PROFILE_FILTER_SIZE)], 1, memory_order_relaxed);
+        sample->site->liveBytes -= sample->weight;
+        sample->site->freedSamples++;
+        sample->site->lifetimeNs += end - sample->start;
+        sample->next = profileFreeSamples;
+        profileFreeSamples = sample;
+    }
+    pthread_mutex_unlock(&profileMutex);
+}
+void profileForget(const void* start, const void* end)
+{
+    // Blocks of a destroyed arena are never freed one by one
+    pthread_mutex_lock(&profileMutex);
+    for(size_t bucket = 0; bucket < PROFILE_SAMPLES; ++bucket)
+    {
+        ProfileSample** link = &profileBuckets[bucket];
+        while(*link != NULL)
+        {
+            ProfileSample* sample = *link;
+            if((uint8_t*)sample->memblock < (uint8_t*)start || (uint8_t*)sample->memblock >= (uint8_t*)end)
+            {
+                link = &sample->next;
+                continue;
+            }
+            *link = sample->next;
+            atomic_fetch_sub_explicit(&profileFilter[profileHash(sample->memblock, PROFILE_FILTER_SIZE)], 1, memory_order_relaxed);
+            sample->site->liveBytes -= sample->weight;
+            sample->next = profileFreeSamples;
+            profileFreeSamples = sample;
+        }
+    }
+    pthread_mutex_unlock(&profileMutex);
+}
+int compareProfileSites(const void* first, const void* second)
+{
+    size_t a = ((const struct heap_profile_site_t*)first)->liveBytes;
+    size_t b = ((const struct heap_profile_site_t*)second)->liveBytes;
+    return (a < b) - (a > b);
+}
+void statsOsBytes(intptr_t delta)
+{
+    size_t total = atomic_fetch_add_explicit(&osBytes, delta, memory_order_relaxed) + delta;
+    size_t peak = atomic_load_explicit(&osPeakBytes, memory_order_relaxed);
+    while(total > peak && !atomic_compare_exchange_weak_explicit(&osPeakBytes, &peak, total, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+bool writeAll(int fd, const void* data, size_t size)
+{
+    for(size_t written = 0; written < size; )
+    {
+        ssize_t result = write(fd, (const uint8_t*)data + written, size - written);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+            return false;
+        written += result;
+    }
+    return true;
+}
+void snapshotFlush(SnapshotWriter* writer)
+{
+    if(!writer->failed && !writeAll(writer->fd, writer->buffer, writer->used))
+        writer->failed = true;
+    writer->used = 0;
+}
+void snapshotWrite(SnapshotWriter* writer, const char* format, ...)
+{
+    char line[SNAPSHOT_LINE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, SNAPSHOT_LINE, format, args);
+    va_end(args);
+    if(length < 0 || length >= SNAPSHOT_LINE)
+    {
+        writer->failed = true;
+        return;
+    }
+    if(writer->used + length > SNAPSHOT_BUFFER)
+        snapshotFlush(writer);
+    memcpy(writer->buffer + writer->used, line, length);
+    writer->used += length;
+}
+void snapshotQuote(char* out, size_t capacity, const char* text)
+{
+    // JSON string or null, long names are cut short
+    if(text == NULL)
+    {
+        strcpy(out, "null");
+        return;
+    }
+    size_t length = 0;
+    out[length++] = '"';
+    for(; *text && length + 8 < capacity; ++text)
+    {
+        if(*text == '"' || *text == '\\')
+            out[length++] = '\\';
+        if((unsigned char)*text < 0x20)
+            length += sprintf(out + length, "\\u%04x", (unsigned char)*text);
+        else
+            out[length++] = *text;
+    }
+    out[length++] = '"';
+    out[length] = '\0';
+}
+void snapshotArena(SnapshotWriter* writer, Arena* arena, unsigned int index)
+{
+    Heap* heap = &arena->heap;
+    SnapshotRecord records[SNAPSHOT_BATCH];
+    char file[SNAPSHOT_LINE / 2];
+
+    pthread_mutex_lock(&arena->mutex);
+    if(heap->isInitialized == false)
+    {
+        pthread_mutex_unlock(&arena->mutex);
+        return;
+    }
+    size_t usedSpace = heapUsedSpace(heap);
+    size_t freeSpace = heapFreeSpace(heap);
+    size_t largestFree = heapLargestFreeArea(heap);
+    uint32_t usedChunks = heap->chunksCount.used;
+    uint32_t freeChunks = heap->chunksCount.free;
+    pthread_mutex_unlock(&arena->mutex);
+    snapshotWrite(writer, "{\"type\":\"arena\",\"arena\":%u,\"private\":%s,\"used_space\":%zu,\"free_space\":%zu,\"used_chunks\":%u,\"free_chunks\":%u,\"largest_free\":%zu}\n",
+                  index, arena->isPrivate ? "true" : "false", usedSpace, freeSpace, usedChunks, freeChunks, largestFree);
+
+    uintptr_t resume = 0;
+    for(bool done = false; !done && !writer->failed; )
+    {
+        size_t count = 0;
+        pthread_mutex_lock(&arena->mutex);
+        if(resume == 0)
+            resume = (uintptr_t)heap->head + 1;
+        if(heap->isInitialized == false || resume > (uintptr_t)heap->tail)
+        {
+            pthread_mutex_unlock(&arena->mutex);
+            break;
+        }
+        // Chunks may have split or merged since the last batch, so go on from the first one past the last copied
+        Chunk* current = chunkMapFind(heap, (void*)resume);
+        if((uintptr_t)current < resume)
+            current = current->next;
+        for(; current != heap->tail && count < SNAPSHOT_BATCH; current = current->next)
+        {
+            SnapshotRecord* record = &records[count++];
+            record->address = current + 1;
+            record->size = current->size;
+            record->state = current->isFree ? "free" : current->isQuick ? "quick" : current->isSlab ? "slab" : "used";
+            record->slotsUsed = !current->isFree && current->isSlab ? ((Slab*)(current + 1))->usedCount : 0;
+            record->fileName = NULL;
+            record->lineNumber = 0;
+#ifdef HEAP_CHUNK_DEBUG
+            record->fileName = chunkDebug(current)->debugParams.fileName;
+            record->lineNumber = chunkDebug(current)->debugParams.lineNumber;
+#endif
+            resume = (uintptr_t)current + 1;
+        }
+        done = current == heap->tail;
+        pthread_mutex_unlock(&arena->mutex);
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            SnapshotRecord* record = &records[i];
+            snapshotQuote(file, sizeof(file), record->fileName);
+            if(record->slotsUsed)
+                snapshotWrite(writer, "{\"type\":\"chunk\",\"arena\":%u,\"address\":\"%p\",\"size\":%zu,\"state\":\"%s\",\"slots_used\":%u,\"file\":%s,\"line\":%d}\n",
+                              index, record->address, record->size, record->state, record->slotsUsed, file, record->lineNumber);
+            else
+                snapshotWrite(writer, "{\"type\":\"chunk\",\"arena\":%u,\"address\":\"%p\",\"size\":%zu,\"state\":\"%s\",\"file\":%s,\"line\":%d}\n",
+                              index, record->address, record->size, record->state, file, record->lineNumber);
+        }
+    }
+}
+void snapshotLargeBlocks(SnapshotWriter* writer)
+{
+    LargeBlock blocks[SNAPSHOT_BATCH];
+    uint8_t* resume = NULL;
+    for(size_t count = SNAPSHOT_BATCH; count == SNAPSHOT_BATCH && !writer->failed; )
+    {
+        pthread_mutex_lock(&largeBlocksMutex);
+        // First block past the last copied one
+        size_t low = 0, high = largeBlocksCount;
+        while(low < high)
+        {
+            size_t middle = (low + high) / 2;
+            if(largeBlocks[middle].memory < resume)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        for(count = 0; low < largeBlocksCount && count < SNAPSHOT_BATCH; ++low)
+            blocks[count++] = largeBlocks[low];
+        pthread_mutex_unlock(&largeBlocksMutex);
+        if(count)
+            resume = blocks[count - 1].memory + 1;
+
+        for(size_t i = 0; i < count; ++i)
+            snapshotWrite(writer, "{\"type\":\"large\",\"address\":\"%p\",\"size\":%zu,\"mapped\":%zu}\n",
+                          (void*)blocks[i].memory, blocks[i].size, blocks[i].mapped);
+    }
+}
+void traceKeyCreate(void)
+{
+    pthread_key_create(&traceKey, traceDestroy);
+}
+void traceRegister(TraceBuffer* buffer)
+{
+    // The key destructor writes out what's left when the thread exits
+    pthread_once(&traceKeyOnce, traceKeyCreate);
+    pthread_setspecific(traceKey, buffer);
+    pthread_mutex_lock(&traceMutex);
+    buffer->thread = ++traceThreads;
+    buffer->prev = NULL;
+    buffer->next = traceBuffers;
+    if(traceBuffers != NULL)
+        traceBuffers->prev = buffer;
+    traceBuffers = buffer;
+    pthread_mutex_unlock(&traceMutex);
+    buffer->isRegistered = true;
+}
+void traceFlush(TraceBuffer* buffer)
+{
+    // Caller holds buffer->lock
+    pthread_mutex_lock(&traceWriteMutex);
+    if(traceFd >= 0 && !traceFailed && !writeAll(traceFd, buffer->records, buffer->count * sizeof(struct heap_trace_record_t)))
+        traceFailed = true;
+    pthread_mutex_unlock(&traceWriteMutex);
+    buffer->count = 0;
+}
+void traceDestroy(void* arg)
+{
+    TraceBuffer* buffer = arg;
+    pthread_mutex_lock(&buffer->lock);
+    traceFlush(buffer);
+    pthread_mutex_unlock(&buffer->lock);
+    pthread_mutex_lock(&traceMutex);
+    if(buffer->prev != NULL)
+        buffer->prev->next = buffer->next;
+    else
+        traceBuffers = buffer->next;
+    if(buffer->next != NULL)
+        buffer->next->prev = buffer->prev;
+    pthread_mutex_unlock(&traceMutex);
+    buffer->isRegistered = false;
+}
+void traceRecord(enum heap_trace_op_t op, const void* memory, const void* old, size_t size, size_t alignment)
+{
+    // Allocations are recorded after they return and frees before they start, so a block's
+    // allocation always comes earlier in time than its free, whichever threads they run on
+    if(!atomic_load_explicit(&traceActive, memory_order_acquire))
+        return;
+    // Failed calls change nothing, realloc to 0 bytes frees the block
+    if(memory == NULL && (op != trace_realloc || size != 0 || old == NULL))
+        return;
+    TraceBuffer* buffer = &traceBuffer;
+    if(!buffer->isRegistered)
+        traceRegister(buffer);
+    pthread_mutex_lock(&buffer->lock);
+    struct heap_trace_record_t* record = &buffer->records[buffer->count++];
+    record->time = profileNow() - traceStart;
+    record->id = (uintptr_t)memory;
+    record->oldId = (uintptr_t)old;
+    record->size = size;
+    record->thread = buffer->thread;
+    record->op = op;
+    record->alignmentShift = alignment ? __builtin_ctzll(alignment) : 0;
+    if(buffer->count == TRACE_BUFFER)
+        traceFlush(buffer);
+    pthread_mutex_unlock(&buffer->lock);
+}
+void updateChunksCount(Heap* heap, int32_t freeChunks, int32_t usedChunks, intptr_t freeBytes, intptr_t usedBytes)
+{
+    sumField(&heap->sumOfBytes, &heap->chunksCount, sizeof(ChunkCount), -1);
+    heap->chunksCount.free += freeChunks;
+    heap->chunksCount.used += usedChunks;
+    heap->chunksCount.freeBytes += freeBytes;
+    heap->chunksCount.usedBytes += usedBytes;
+    sumField(&heap->sumOfBytes, &heap->chunksCount, sizeof(ChunkCount), 1);
+}
+
+void* heapMalloc(Heap* heap, size_t count, int fileline, const char* filename)
+{
+    if(!heap->isInitialized){
+        ConsoleLog(__f, "Heap isn't initialized");
+        return NULL;
+    }
+    heapDrainRemote(heap);
+    if(!count)
+    {
+        ConsoleLog(__f, "Invalid count");
+        return NULL;
+    }
+    size_t allocateSize = ceilWord(count);
+    // Private arenas keep every block inside so heap_arena_destroy can drop them
+    size_t threshold = atomic_load_explicit(&mmapThreshold, memory_order_relaxed);
+    if(threshold != 0 && allocateSize >= threshold && !((Arena*)heap)->isPrivate)
+        return largeMalloc(allocateSize, 0);
+    if(allocateSize > INT32_MAX - PAGE_SIZE)
+    {
+        ConsoleLog(__f, "Couldn't get enough space from OS");
+        return NULL;
+    }
+    if(allocateSize <= SLAB_MAX_SIZE && atomic_load_explicit(&slabEnabled, memory_order_relaxed))
+    {
+        void* memory = slabMalloc(heap, allocateSize);
+        if(memory != NULL)
+            return memory;
+    }
+    return heapMallocChunk(heap, allocateSize, fileline, filename);
+}
+void* heapMallocChunk(Heap* heap, size_t allocateSize, int fileline, const char* filename)
+{
+    Chunk* temp = allocateSize <= QUICK_LIST_MAX_SIZE ? quickPop(heap, allocateSize) : NULL;
+    if(temp != NULL)
+    {
+        // Parked chunks fit exactly and were never merged, so there's nothing to split
+        setDebugParams(temp, fileline, filename);
+        setSum(1, temp);
+        return temp+1;
+    }
+    temp = findFreeChunk(heap, allocateSize);
+    if(temp == NULL && heap->quick.bytes != 0)
+    {
+        // A miss merges parked chunks before the heap grows
+        heapConsolidate(heap);
+        temp = findFreeChunk(heap, allocateSize);
+    }
+    if(temp == NULL)
+    {
+        int32_t currentSize = 0;
+        Chunk *previousBlock = heap->tail->prev;
+        if(previousBlock->isFree)
+            currentSize += previousBlock->size;
+        size_t need_bytes = allocateSize - currentSize + sizeof(Chunk);
+        intptr_t need_pages = need_bytes / PAGE_SIZE;
+        if(need_bytes % PAGE_SIZE != 0) need_pages++;
+        int err = getSpace(heap, need_pages);
+        if(err == -1) {
+            ConsoleLog(__f, "Couldn't get enough space from OS");
+            return NULL;
+        }
+        // getSpace merged the new pages into the last free chunk
+        temp = heap->tail->prev;
+    }
+    if(temp->size - allocateSize > sizeof(Chunk))
+        splitChunk(heap, temp, allocateSize);
+    setDebugParams(temp, fileline, filename);
+    setChunkUsed(heap, temp);
+    return temp+1;
+}
+size_t carveRun(Heap* heap, Chunk* chunk, size_t size, size_t count, void** out, int fileline, const char* filename)
+{
+    // The run leaves its bin once and only the remainder goes back, instead of a split per block
+    size_t stride = size + sizeof(Chunk);
+    size_t total = chunk->size;
+    size_t fits = (total + sizeof(Chunk)) / stride;
+    if(fits > count)
+        fits = count;
+    size_t leftover = total + sizeof(Chunk) - fits * stride;
+    Chunk* next = chunk->next;
+    binRemove(heap, chunk);
+    Chunk* current = chunk;
+    for(size_t i = 0; i < fits; ++i)
+    {
+        current = (Chunk*)((uchar*)chunk + i * stride);
+        current->size = size;
+        current->isFree = false;
+        current->isSlab = false;
+        current->isQuick = false;
+        current->prev = i == 0 ? chunk->prev : (Chunk*)((uchar*)current - stride);
+        current->next = (Chunk*)((uchar*)current + stride);
+        current->nextFree = current->prevFree = NULL;
+        if(i != 0)
+            chunkMapSet(heap, current, true);
+        setFences(1, current);
+        setDebugParams(current, fileline, filename);
+        out[i] = current + 1;
+    }
+    if(leftover > sizeof(Chunk))
+    {
+        Chunk* rest = current->next;
+        rest->size = leftover - sizeof(Chunk);
+        rest->isFree = true;
+        rest->isSlab = false;
+        rest->isQuick = false;
+        rest->prev = current;
+        rest->next = next;
+        chunkMapSet(heap, rest, true);
+        setFences(1, rest);
+        setDebugParams(rest, 0, NULL);
+        setChunkLink(next, &next->prev, rest);
+        binInsert(heap, rest);
+    }
+    else
+    {
+        // Too little left for a chunk, the last block keeps it
+        current->size += leftover;
+        current->next = next;
+        setChunkLink(next, &next->prev, current);
+    }
+    for(size_t i = 0; i < fits; ++i)
+    {
+        usedInsert(heap, (Chunk*)((uchar*)chunk + i * stride));
+        setSum(1, (Chunk*)((uchar*)chunk + i * stride));
+    }
+    updateChunksCount(heap, 0, fits, 0, 0);
+    return fits;
+}
+size_t heapMallocChunks(Heap* heap, size_t allocateSize, size_t count, void** out, int fileline, const char* filename)
+{
+    size_t stride = allocateSize + sizeof(Chunk);
+    size_t taken = 0;
+    while(taken < count)
+    {
+        // A chunk holding the whole rest of the batch keeps it contiguous
+        size_t remaining = count - taken;
+        size_t runSize = remaining > (INT32_MAX - PAGE_SIZE) / stride ? 0 : remaining * stride - sizeof(Chunk);
+        Chunk* chunk = runSize ? findFreeChunk(heap, runSize) : NULL;
+        if(chunk == NULL)
+            chunk = findFreeChunk(heap, allocateSize);
+        if(chunk == NULL && heap->quick.bytes != 0)
+        {
+            heapConsolidate(heap);
+            continue;
+        }
+        if(chunk == NULL)
+        {
+            if(runSize == 0)
+                runSize = allocateSize;
+            size_t currentSize = heap->tail->prev->isFree ? heap->tail->prev->size : 0;
+            size_t needBytes = runSize + sizeof(Chunk) - currentSize;
+            if(getSpace(heap, (needBytes + PAGE_SIZE - 1) / PAGE_SIZE) == -1)
+            {
+                ConsoleLog(__f, "Couldn't get enough space from OS");
+                break;
+            }
+            // getSpace merged the new pages into the last free chunk
+            chunk = heap->tail->prev;
+        }
+        taken += carveRun(heap, chunk, allocateSize, remaining, out + taken, fileline, filename);
+    }
+    return taken;
+}
+size_t heapMallocBatch(Heap* heap, size_t size, size_t count, void** out, int fileline, const char* filename)
+{
+    if(!heap->isInitialized){
+        ConsoleLog(__f, "Heap isn't initialized");
+        return 0;
+    }
+    heapDrainRemote(heap);
+    if(!size || out == NULL)
+    {
+        ConsoleLog(__f, "Invalid count");
+        return 0;
+    }
+    size_t allocateSize = ceilWord(size);
+    size_t threshold = atomic_load_explicit(&mmapThreshold, memory_order_relaxed);
+    bool large = threshold != 0 && allocateSize >= threshold && !((Arena*)heap)->isPrivate;
+    bool slab = allocateSize <= SLAB_MAX_SIZE && atomic_load_explicit(&slabEnabled, memory_order_relaxed);
+    if(!large && allocateSize > INT32_MAX - PAGE_SIZE)
+    {
+        ConsoleLog(__f, "Couldn't get enough space from OS");
+        return 0;
+    }
+    size_t taken = 0;
+    // Slab slots and mappings are cheap one by one, only the lock is shared
+    for(; (large || slab) && taken < count; ++taken)
+    {
+        out[taken] = large ? largeMalloc(allocateSize, 0) : slabMalloc(heap, allocateSize);
+        if(out[taken] == NULL)
+            break;
+    }
+    if(large)
+        return taken;
+    return taken + heapMallocChunks(heap, allocateSize, count - taken, out + taken, fileline, filename);
+}
+void* heapCalloc(Heap* heap, size_t number, size_t size, int fileline, const char* filename)
+{
+    if(SIZE_MAX / size < number){
+        ConsoleLog(__f, "Overflow");
+        return NULL;
+    }
+    void* start = heapMalloc(heap, size * number, fileline, filename);
+    if(start == NULL){
+        ConsoleLog(__f, "Couldn't allocate memory");
+        return NULL;
+    }
+    memset(start, 0, size*number);
+    return start;
+}
+Chunk* heapReallocInPlace(Heap* heap, Chunk* current, size_t amount)
+{
+    // Grows a used chunk into its free neighbours or the end of the heap, NULL when none of them fit
+    Chunk* next = current->next;
+    Chunk* prev = current->prev;
+    size_t available = current->size + (next->isFree ? next->size + sizeof(Chunk) : 0);
+    bool isLast = (next->isFree ? next->next : next) == heap->tail;
+    if(available < amount && prev->isFree && prev->size + sizeof(Chunk) + available >= amount)
+    {
+        // Data moves down into the free chunk before it, the headers are done with by then
+        size_t oldSize = current->size;
+        void* memblock = current + 1;
+        if(next->isFree)
+            mergeChunks(heap, current, next);
+        // prev takes over as the used block
+        usedRemove(heap, current);
+        binRemove(heap, prev);
+        prev->isFree = false;
+        chunkMapSet(heap, current, false);
+        setChunkLink(current->next, &current->next->prev, prev);
+        prev->next = current->next;
+        prev->size += current->size + sizeof(Chunk);
+        usedInsert(heap, prev);
+        memmove(prev + 1, memblock, oldSize);
+        current = prev;
+    }
+    else if(available < amount)
+    {
+        size_t threshold = atomic_load_explicit(&mmapThreshold, memory_order_relaxed);
+        if(!isLast || amount > INT32_MAX - PAGE_SIZE || (threshold != 0 && amount >= threshold && !((Arena*)heap)->isPrivate))
+            return NULL;
+        // getSpace leaves the new pages in a free chunk right after current
+        if(getSpace(heap, (amount - available + PAGE_SIZE - 1) / PAGE_SIZE) == -1)
+            return NULL;
+    }
+    if(current->size < amount)
+        mergeChunks(heap, current, current->next);
+    if(current->size - amount > sizeof(Chunk))
+        splitChunk(heap, current, amount);
+    return current;
+}
+void* heapRealloc(Heap* heap, void* memblock, size_t size, int fileline, const char* filename)
+{
+    if(heap->isInitialized == false) {
+        ConsoleLog(__f, "Heap doesn't exists");
+        return NULL;
+    }
+    if(!memblock)
+        return heapMalloc(heap, size, fileline, filename);
+    if(size == 0){
+        heapFree(heap, memblock);
+        return NULL;
+    }
+    Chunk* current = (Chunk*)((uchar*)memblock - sizeof(Chunk));
+    if(!chunkExists(heap, current))
+    {
+        Slab* slab = slabOf(heap, memblock);
+        if(slab != NULL)
+            return slabRealloc(heap, slab, memblock, size, 0, fileline, filename);
+        if(largeBlockSize(memblock) != 0)
+            return largeRealloc(heap, memblock, size, 0, fileline, filename);
+    }
+    size_t amount = ceilWord(size);
+    if(current->size == amount)
+        {
+            setDebugParams(current, fileline, filename);
+            setSum(1, current);
+            return memblock;
+        }
+    else if(current->size < amount)
+    {
+        Chunk* resized = heapReallocInPlace(heap, current, amount);
+        if(resized != NULL)
+        {
+            setDebugParams(resized, fileline, filename);
+            setSum(1, resized);
+            return resized + 1;
+        }
+        void* newChunk = heapMalloc(heap, amount, fileline, filename);
+        if(newChunk == NULL)
+        {
+            ConsoleLog(__f, "Malloc couldn't allocate memory");
+            return NULL;
+        }
+        // heapMalloc already set debug params, the new block may sit in a slab
+        memcpy(newChunk, memblock, current->size);
+        heapFree(heap, memblock);
+        return newChunk;
+    }
+    else
+    {
+        if(current->size - amount <= sizeof(Chunk))
+        {
+            if(current->next->isFree) {
+                // Move the boundary between current and its free neighbour
+                mergeChunks(heap, current, current->next);
+                splitChunk(heap, current, amount);
+                setDebugParams(current, fileline, filename);
+                setSum(1, current);
+            }
+            return memblock;
+        } else
+        {
+            splitChunk(heap, current, amount);
+            current->isFree = false;
+            if(current->next->next->isFree){
+                mergeChunks(heap, current->next, current->next->next);
+            }
+            setDebugParams(current, fileline, filename);
+            setSum(1, current);
+            return memblock;
+        }
+
+    }
+    setDebugParams(current, fileline, filename);
+    setSum(1, current);
+    return memblock;
+}
+void heapFree(Heap* heap, void* memblock)
+{
+    bool exists = chunkExists(heap, (Chunk*)((uchar*)memblock-sizeof(Chunk)));
+    if(!exists){
+        Slab* slab = slabOf(heap, memblock);
+        if(slab != NULL)
+            return slabFree(heap, slab, memblock);
+        if(largeFree(memblock, 0))
+            return;
+        ConsoleLog(__f, "Invalid chunk <not exists>");
+        return;
+    }
+    if(((Chunk*)memblock - 1)->isSlab){
+        ConsoleLog(__f, "Invalid chunk <not exists>");
+        return;
+    }
+    Chunk* chunk = (Chunk*)((uchar*)memblock-sizeof(Chunk));
+    if(chunk->isFree == true || chunk->isQuick)
+    {
+        ConsoleLog(__f, "Double free deteched");
+        return;
+    }
+    size_t limit = atomic_load_explicit(&deferredLimit, memory_order_relaxed);
+    if(limit != 0 && chunk->size <= QUICK_LIST_MAX_SIZE)
+        quickPush(heap, chunk);
+    else
+    {
+        setChunkFree(heap, chunk);
+        if(chunk->next->isFree)
+            mergeChunks(heap, chunk, chunk->next);
+        if(chunk->prev->isFree)
+            mergeChunks(heap, chunk->prev, chunk);
+    }
+    // Parked chunks are merged in one pass past the limit, or right away once deferring is off
+    if(heap->quick.bytes > limit)
+        heapConsolidate(heap);
+    // Trimming down to half of the threshold keeps grow/shrink cycles from hitting the OS each time
+    size_t threshold = atomic_load_explicit(&trimThreshold, memory_order_relaxed);
+    if(threshold != 0 && heap->tail->prev->isFree && heap->tail->prev->size > threshold)
+        heapTrim(heap, threshold / 2);
+}
+
+void heapFreeBatch(Heap* heap, void** memblocks, size_t count)
+{
+    // memblocks are sorted by address, so neighbouring blocks merge before touching the bins
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(memblocks[i] == NULL)
+            continue;
+        Chunk* first = (Chunk*)memblocks[i] - 1;
+        if(!chunkExists(heap, first) || first->isFree || first->isSlab || first->isQuick)
+        {
+            // Slab slots, mappings and bad pointers take the single block path and its logs
+            heapFree(heap, memblocks[i]);
+            continue;
+        }
+        Chunk* last = first;
+        size_t runLength = 1;
+        usedRemove(heap, first);
+        while(i + 1 < count && memblocks[i + 1] == (void*)(last->next + 1) && !last->next->isFree && !last->next->isSlab && !last->next->isQuick)
+        {
+            last = last->next;
+            usedRemove(heap, last);
+            chunkMapSet(heap, last, false);
+            runLength++;
+            i++;
+        }
+        // Headers inside the run become data of the first chunk
+        first->size = (uchar*)last + sizeof(Chunk) + last->size - (uchar*)(first + 1);
+        first->next = last->next;
+        setChunkLink(last->next, &last->next->prev, first);
+        updateChunksCount(heap, 0, -(int32_t)runLength, 0, 0);
+        first->isFree = true;
+        binInsert(heap, first);
+        if(first->next->isFree)
+            mergeChunks(heap, first, first->next);
+        if(first->prev->isFree)
+            mergeChunks(heap, first->prev, first);
+    }
+    size_t threshold = atomic_load_explicit(&trimThreshold, memory_order_relaxed);
+    if(threshold != 0 && heap->tail->prev->isFree && heap->tail->prev->size > threshold)
+        heapTrim(heap, threshold / 2);
+}
+void heapFreeSized(Heap* heap, void* memblock, size_t size)
+{
+    // Size 0 means no hint; a slab sized hint looks up the slab before the chunk
+#ifdef HEAP_CHUNK_DEBUG
+    if(size != 0)
+        heapCheckSizeHint(heap, memblock, size);
+#endif
+    if(size != 0 && ceilWord(size) <= SLAB_MAX_SIZE && atomic_load_explicit(&slabEnabled, memory_order_relaxed))
+    {
+        Slab* slab = slabOf(heap, memblock);
+        if(slab != NULL)
+            return slabFree(heap, slab, memblock);
+    }
+    heapFree(heap, memblock);
+}
+void* heapReallocSized(Heap* heap, void* memblock, size_t oldSize, size_t size, int fileline, const char* filename)
+{
+    // Under the lock heapRealloc would take, a slab sized hint looks up the slab before the chunk
+#ifdef HEAP_CHUNK_DEBUG
+    heapCheckSizeHint(heap, memblock, oldSize);
+#endif
+    // Same size class, the block already fits
+    if(ceilWord(size) == ceilWord(oldSize))
+        return memblock;
+    if(ceilWord(oldSize) <= SLAB_MAX_SIZE && atomic_load_explicit(&slabEnabled, memory_order_relaxed))
+    {
+        Slab* slab = slabOf(heap, memblock);
+        if(slab != NULL)
+            return slabRealloc(heap, slab, memblock, size, 0, fileline, filename);
+    }
+    return heapRealloc(heap, memblock, size, fileline, filename);
+}
+bool chunkFitsHint(const Chunk* chunk, size_t hint)
+{
+    // Chunks keep leftovers too small to split and thread cache blocks have a minimum size
+    return hint <= (size_t)chunk->size && chunk->size - hint <= sizeof(Chunk) + sizeof(CachedBlock);
+}
+int heapCheckSizeHint(Heap* heap, const void* memblock, size_t size)
+{
+    // Blocks the heap doesn't know are left for the free to report
+    size_t hint = ceilWord(size);
+    Chunk* chunk = (Chunk*)memblock - 1;
+    if(chunkExists(heap, chunk) && !chunk->isSlab)
+    {
+        if(chunk->isFree || chunk->isQuick || chunkFitsHint(chunk, hint))
+            return 0;
+        return printf("%s : Block of %d bytes freed as %zu bytes\n", __f, chunk->size, size), -1;
+    }
+    Slab* slab = slabOf(heap, memblock);
+    if(slab != NULL)
+    {
+        if(slab->slotSize == hint)
+            return 0;
+        return printf("%s : Slot of %u bytes freed as %zu bytes\n", __f, slab->slotSize, size), -1;
+    }
+    size_t blockSize = largeBlockSize(memblock);
+    if(blockSize != 0 && blockSize != hint)
+        return printf("%s : Mapping of %zu bytes freed as %zu bytes\n", __f, blockSize, size), -1;
+    return 0;
+}
+
+Chunk* findAligned(Heap* heap, size_t size, size_t alignment)
+{
+    if(heap->isInitialized==false)
+    {
+        ConsoleLog(__f, "Heap isn't initialized");
+        return NULL;
+    }
+    if(atomic_load_explicit(&placementPolicy, memory_order_relaxed) != placement_segregated)
+    {
+        // The policy picks among chunks that fit whatever the padding
+        Chunk* current = treeFind(heap, size + alignment + sizeof(Chunk) + sizeof(void*));
+        if(current != NULL)
+            return carveAligned(heap, current, size, alignment);
+    }
+    // Any free chunk big enough for the block alone is a candidate, the padding decides
+    for(unsigned int index = binIndex(size); index < BINS_COUNT; ++index)
+    {
+        for(Chunk* current = heap->bins[index]; current != NULL; current = current->nextFree)
+        {
+            Chunk* carved = carveAligned(heap, current, size, alignment);
+            if(carved != NULL)
+                return carved;
+        }
+    }
+    return NULL;
+}
+Chunk* carveAligned(Heap* heap, Chunk* current, size_t size, size_t alignment)
+{
+    // NULL when the aligned block doesn't fit in the free chunk
+    if((size_t)current->size < size)
+        return NULL;
+    intptr_t dataStart = (intptr_t)(current + 1);
+    intptr_t memoryStart = alignedMemory(dataStart, alignment);
+    if(memoryStart + size > dataStart + current->size)
+        return NULL;
+    if(memoryStart != dataStart)
+    {
+        // Leading gap stays free in its bin
+        splitChunk(heap, current, memoryStart - dataStart - sizeof(Chunk));
+        current = current->next;
+    }
+    if(current->size - size > sizeof(Chunk))
+        splitChunk(heap, current, size);
+    setChunkUsed(heap, current);
+    return current;
+}
+intptr_t alignedMemory(intptr_t start, size_t alignment)
+{
+    if(start % alignment == 0)
+        return start;
+    // Padding must fit a free chunk header and a word of data
+    intptr_t memory = start + sizeof(Chunk) + sizeof(void*);
+    return (memory + alignment - 1) & ~(intptr_t)(alignment - 1);
+}
+void* heapMallocAligned(Heap* heap, size_t count, size_t alignment, int fileline, const char* filename)
+{
+    if(!heap->isInitialized){
+        ConsoleLog(__f, "Heap isn't initialized");
+        return NULL;
+    }
+    heapDrainRemote(heap);
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        ConsoleLog(__f, "Invalid alignment");
+        return NULL;
+    }
+    if(!count)
+    {
+        ConsoleLog(__f, "Invalid count");
+        return NULL;
+    }
+    // Every chunk and slab slot is word aligned already
+    if(alignment <= sizeof(void*))
+        return heapMalloc(heap, count, fileline, filename);
+    size_t allocateSize = ceilWord(count);
+    size_t threshold = atomic_load_explicit(&mmapThreshold, memory_order_relaxed);
+    if(threshold != 0 && allocateSize >= threshold && !((Arena*)heap)->isPrivate)
+        return largeMalloc(allocateSize, alignment);
+    if(allocateSize > INT32_MAX - PAGE_SIZE || alignment > INT32_MAX - PAGE_SIZE - allocateSize)
+    {
+        ConsoleLog(__f, "Couldn't get enough space from OS");
+        return NULL;
+    }
+    Chunk* chunk = findAligned(heap, allocateSize, alignment);
+    if(chunk == NULL && heap->quick.bytes != 0)
+    {
+        heapConsolidate(heap);
+        chunk = findAligned(heap, allocateSize, alignment);
+    }
+    if(chunk == NULL)
+    {
+        // Grow once by the worst case padding, the new pages join the last free chunk
+        size_t currentSize = heap->tail->prev->isFree ? heap->tail->prev->size : 0;
+        size_t needBytes = allocateSize + alignment + 2 * sizeof(Chunk) + sizeof(void*);
+        intptr_t needPages = 1;
+        if(needBytes > currentSize)
+            needPages = (needBytes - currentSize + PAGE_SIZE - 1) / PAGE_SIZE;
+        if(getSpace(heap, needPages) != 1)
+        {
+            ConsoleLog(__f, "custom_sbrk failed");
+            return NULL;
+        }
+        chunk = findAligned(heap, allocateSize, alignment);
+        if(chunk == NULL)
+        {
+            ConsoleLog(__f, "Couldn't fit aligned block");
+            shrinkTail(heap, needPages);
+            return NULL;
+        }
+    }
+    setFences(1, chunk);
+    setDebugParams(chunk, fileline, filename);
+    setSum(1, chunk);
+    return (uchar*)chunk + sizeof(Chunk);
+}
+void* heapReallocAligned(Heap* heap, void* memblock, size_t size, size_t alignment, int fileline, const char* filename)
+{
+    if(heap->isInitialized == false) {
+        ConsoleLog(__f, "Heap doesn't exists");
+        return NULL;
+    }
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        ConsoleLog(__f, "Invalid alignment");
+        return NULL;
+    }
+    if(alignment <= sizeof(void*))
+        return heapRealloc(heap, memblock, size, fileline, filename);
+    if(memblock == NULL)
+        return heapMallocAligned(heap, size, alignment, fileline, filename);
+    if(size == 0)
+        return heapFree(heap, memblock), NULL;
+    Chunk* current = (Chunk*)((uchar*)memblock - sizeof(Chunk));
+    if(!chunkExists(heap, current))
+    {
+        Slab* slab = slabOf(heap, memblock);
+        if(slab != NULL)
+            return slabRealloc(heap, slab, memblock, size, alignment, fileline, filename);
+        if(largeBlockSize(memblock) != 0)
+            return largeRealloc(heap, memblock, size, alignment, fileline, filename);
+    }
+     if((intptr_t)memblock % alignment != 0)
+    {
+        void* newChunk = heapMallocAligned(heap, size, alignment, fileline, filename);
+        if(newChunk == NULL)
+        {
+            ConsoleLog(__f, "Malloc failed");
+            return NULL;
+        }
+        // The new block may be smaller, or a mapping without a chunk header
+        memcpy(newChunk, memblock, ceilWord(size) < current->size ? ceilWord(size) : current->size);
+        heapFree(heap, memblock);
+        return newChunk;
+    }
+    size_t amount = ceilWord(size);
+    size_t sizeWithNext = current->size + sizeof(Chunk) + current->next->size;
+    intptr_t left = (intptr_t)sizeWithNext-(intptr_t)amount;
+    if(current->size == amount){
+        setDebugParams(current, fileline, filename);
+        setSum(1, current);
+        return memblock;
+    }
+    else if(current->size < amount)
+    {
+        if(current->next->isFree && left==0)
         {
-            mergeChunks(current, current->next);
+            mergeChunks(heap, current, current->next);
             current->isFree = false;
-            current->debugParams.lineNumber = fileline;
-            current->debugParams.fileName = filename;
+            // dodane
+            setDebugParams(current, fileline, filename);
             setSum(1, current);
-            updateChunksCount();
             return memblock;
         }
         else if(current->next->isFree && left < 0)
         {
-            void* newChunk = heap_malloc_nts_debug(amount, fileline, filename);
+            void* newChunk = heapMallocAligned(heap, amount, alignment, fileline, filename);
             if(newChunk == NULL)
+            {
+                ConsoleLog(__f, "Malloc couldn't allocate memory");
                 return NULL;
+            }
             memcpy(newChunk, memblock, current->size);
-            Chunk* temp = (Chunk*)((uchar*)newChunk - sizeof(Chunk));
-            temp->isFree = false;
-            temp->debugParams.lineNumber = fileline;
-            temp->debugParams.fileName = filename;
-            heap_free_nts(memblock);
-            setSum(1, temp);
+            heapFree(heap, memblock);
             return newChunk;
         }
         else if(current->next->isFree && left > 0)
         {
-            mergeChunks(current, current->next);
-            if(left > sizeof(Chunk)){
-                splitChunk(current, amount);
-            }
-            current->isFree = false;
-            current->debugParams.lineNumber = fileline;
-            current->debugParams.fileName = filename;
-            // DELETE
-            current->next->debugParams.fileName = NULL;
-            setSum(2, current, current->next);
-            updateChunksCount();
-            return memblock;
+            mergeChunks(heap, current, current->next);
+            if(left > sizeof(Chunk)){
+                splitChunk(heap, current, amount);
+            }
+            current->isFree = false;
+            setDebugParams(current, fileline, filename);
+            setSum(1, current);
+            return memblock;
+        }
+        else if(current->next->isFree == false)
+        {
+            void* newChunk = heapMallocAligned(heap, amount, alignment, fileline, filename);
+            if(newChunk == NULL)
+            {
+                ConsoleLog(__f, "Malloc couldn't allocate memory");
+                return NULL;
+            }
+            memcpy(newChunk, memblock, current->size);
+            heapFree(heap, memblock);
+            return newChunk;
+        }
+    }
+    else
+    {
+        if(current->size - amount <= sizeof(Chunk))
+        {
+            if(current->next->isFree) {
+                // Move the boundary between current and its free neighbour
+                mergeChunks(heap, current, current->next);
+                splitChunk(heap, current, amount);
+            }
+            setDebugParams(current, fileline, filename);
+            setSum(1, current);
+            return memblock;
+        } else
+        {
+            splitChunk(heap, current, amount);
+            current->isFree = false;
+            if(current->next->next->isFree){
+                mergeChunks(heap, current->next, current->next->next);
+            }
+            setDebugParams(current, fileline, filename);
+            setSum(1, current);
+            return memblock;
+        }
+
+    }
+    return memblock;
+}
+void* heapCallocAligned(Heap* heap, size_t number, size_t size, size_t alignment, int fileline, const char* filename)
+{
+    if(SIZE_MAX / size < number){
+        ConsoleLog(__f, "Overflow");
+        return NULL;
+    }
+    void* start = heapMallocAligned(heap, size * number, alignment, fileline, filename);
+    if(start == NULL){
+        ConsoleLog(__f, "Couldn't allocate memory");
+        return NULL;
+    }
+    memset(start, 0, size*number);
+    return start;
+}
+
+void threadCacheKeyCreate(void)
+{
+    pthread_key_create(&threadCacheKey, threadCacheDestroy);
+}
+void threadCacheRegister(ThreadCache* cache)
+{
+    if(cache->isRegistered)
+        return;
+    // The key destructor gives cached blocks back when the thread exits
+    pthread_once(&threadCacheKeyOnce, threadCacheKeyCreate);
+    pthread_setspecific(threadCacheKey, cache);
+    pthread_mutex_lock(&threadCachesMutex);
+    cache->prev = NULL;
+    cache->next = threadCaches;
+    if(threadCaches != NULL)
+        threadCaches->prev = cache;
+    threadCaches = cache;
+    pthread_mutex_unlock(&threadCachesMutex);
+    cache->isRegistered = true;
+}
+void* threadCacheMalloc(size_t count)
+{
+    size_t limit = atomic_load_explicit(&threadCacheLimit, memory_order_relaxed);
+    if(limit == 0 || count == 0 || count > THREAD_CACHE_MAX_SIZE)
+        return NULL;
+    size_t size = ceilWord(count) < sizeof(CachedBlock) ? sizeof(CachedBlock) : ceilWord(count);
+    unsigned int index = size / sizeof(void*) - 1;
+    ThreadCache* cache = &threadCache;
+    threadCacheRegister(cache);
+    pthread_mutex_lock(&cache->lock);
+    CachedBlock* block = cache->bins[index];
+    if(block != NULL)
+    {
+        cache->bins[index] = block->next;
+        cache->cachedBytes -= ((Chunk*)block - 1)->size;
+        cache->cachedBlocks--;
+        block->key = 0;
+        pthread_mutex_unlock(&cache->lock);
+        return block;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return threadCacheRefill(cache, index, limit);
+}
+void* threadCacheRefill(ThreadCache* cache, unsigned int index, size_t limit)
+{
+    size_t size = (index + 1) * sizeof(void*);
+    size_t count = 1;
+    void* blocks[THREAD_CACHE_BATCH];
+    pthread_mutex_lock(&cache->lock);
+    if(cache->cachedBytes < limit)
+        count += (limit - cache->cachedBytes) / size;
+    pthread_mutex_unlock(&cache->lock);
+    if(count > THREAD_CACHE_BATCH)
+        count = THREAD_CACHE_BATCH;
+    // Blocks of private arenas can't outlive heap_arena_destroy in a cache
+    Arena* arena = threadArena();
+    if(arena->isPrivate)
+        return NULL;
+    size_t taken = 0;
+    pthread_mutex_lock(&arena->mutex);
+    // Cached blocks need a chunk header, so they never come from slabs
+    if(arena->heap.isInitialized)
+    {
+        heapDrainRemote(&arena->heap);
+        taken = heapMallocChunks(&arena->heap, size, count, blocks, 0, NULL);
+    }
+    arenaUnlock(arena);
+    if(taken == 0)
+        return NULL;
+    // The first block goes to the caller, the rest wait in the cache
+    pthread_mutex_lock(&cache->lock);
+    for(size_t i = 1; i < taken; ++i)
+    {
+        CachedBlock* block = blocks[i];
+        block->next = cache->bins[index];
+        block->key = (uintptr_t)cache ^ RANDOM_FENCE_VALUE;
+        cache->bins[index] = block;
+        cache->cachedBytes += ((Chunk*)block - 1)->size;
+        cache->cachedBlocks++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return blocks[0];
+}
+bool threadCacheFree(void* memblock, size_t size)
+{
+    size_t limit = atomic_load_explicit(&threadCacheLimit, memory_order_relaxed);
+    if(limit == 0 || memblock == NULL)
+        return false;
+    // Anything that doesn't look like a small used chunk of a shared arena takes the locked path
+    Arena* arena = sharedArenaOf(memblock);
+    Chunk* chunk = (Chunk*)memblock - 1;
+    if(arena == NULL || chunk <= arena->heap.head || (intptr_t)memblock % sizeof(void*) != 0)
+        return false;
+    // Slab slots have no header of their own
+    if(!chunkMapTest(&arena->heap, chunk))
+        return false;
+#ifdef HEAP_CHUNK_DEBUG
+    if(chunkDebug(chunk)->firstFence != RANDOM_FENCE_VALUE || chunkDebug(chunk)->secondFence != RANDOM_FENCE_VALUE)
+        return false;
+#endif
+    if(chunk->isFree || chunk->isQuick)
+        return false;
+    if(chunk->size < sizeof(CachedBlock) || chunk->size > THREAD_CACHE_MAX_SIZE)
+        return false;
+#ifdef HEAP_CHUNK_DEBUG
+    // A size hint that doesn't fit goes to the locked path, which reports it
+    if(size != 0 && !chunkFitsHint(chunk, ceilWord(size)))
+        return false;
+#endif
+    ThreadCache* cache = &threadCache;
+    threadCacheRegister(cache);
+    CachedBlock* block = memblock;
+    unsigned int index = chunk->size / sizeof(void*) - 1;
+    pthread_mutex_lock(&cache->lock);
+    if(block->key == ((uintptr_t)cache ^ RANDOM_FENCE_VALUE))
+    {
+        // Refilled blocks may sit in a smaller class than their size
+        for(unsigned int i = 0; i <= index; ++i)
+            for(CachedBlock* temp = cache->bins[i]; temp != NULL; temp = temp->next)
+                if(temp == block)
+                {
+                    pthread_mutex_unlock(&cache->lock);
+                    ConsoleLog(__f, "Double free deteched");
+                    return true;
+                }
+    }
+    block->next = cache->bins[index];
+    block->key = (uintptr_t)cache ^ RANDOM_FENCE_VALUE;
+    cache->bins[index] = block;
+    cache->cachedBytes += chunk->size;
+    cache->cachedBlocks++;
+    bool overLimit = cache->cachedBytes > limit;
+    pthread_mutex_unlock(&cache->lock);
+    if(overLimit)
+        threadCacheFlush(cache, limit / 2);
+    return true;
+}
+void threadCacheFlush(ThreadCache* cache, size_t keepBytes)
+{
+    CachedBlock* flushed = NULL;
+    pthread_mutex_lock(&cache->lock);
+    for(int index = THREAD_CACHE_CLASSES - 1; index >= 0 && cache->cachedBytes > keepBytes; --index)
+    {
+        while(cache->bins[index] != NULL && cache->cachedBytes > keepBytes)
+        {
+            CachedBlock* block = cache->bins[index];
+            cache->bins[index] = block->next;
+            cache->cachedBytes -= ((Chunk*)block - 1)->size;
+            cache->cachedBlocks--;
+            block->next = flushed;
+            flushed = block;
         }
-        else if(current->next->isFree == false)
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if(flushed == NULL)
+        return;
+    // Lock is switched only when the next block belongs to another arena
+    Arena* locked = NULL;
+    while(flushed != NULL)
+    {
+        CachedBlock* next = flushed->next;
+        Arena* arena = arenaOf(flushed);
+        if(arena != locked)
         {
-            void* newChunk = heap_malloc_nts_debug(amount, fileline, filename);
-            if(newChunk == NULL)
-            {
-                ConsoleLog(__f, "Malloc couldn't allocate memory");
-                return NULL;
-            }
-            memcpy(newChunk, memblock, current->size);
-            Chunk* temp = (Chunk*)((uchar*)newChunk - sizeof(Chunk));
-            temp->isFree = false;
-            temp->debugParams.lineNumber = fileline;
-            temp->debugParams.fileName = filename;
-            setSum(1, temp);
-            heap_free_nts(memblock);
-            return newChunk;
+            if(locked != NULL)
+                arenaUnlock(locked);
+            pthread_mutex_lock(&arena->mutex);
+            locked = arena;
         }
+        flushed->key = 0;
+        heapFree(&arena->heap, flushed);
+        flushed = next;
     }
+    arenaUnlock(locked);
+}
+void threadCacheDestroy(void* arg)
+{
+    ThreadCache* cache = arg;
+    threadCacheFlush(cache, 0);
+    pthread_mutex_lock(&threadCachesMutex);
+    if(cache->prev != NULL)
+        cache->prev->next = cache->next;
     else
+        threadCaches = cache->next;
+    if(cache->next != NULL)
+        cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&threadCachesMutex);
+    cache->isRegistered = false;
+}
+int threadCacheValidate(ThreadCache* cache)
+{
+    // Caller holds threadCachesMutex and cache->lock
+    size_t bytes = 0;
+    uint64_t blocks = 0;
+    for(unsigned int index = 0; index < THREAD_CACHE_CLASSES; ++index)
     {
-        if(current->size - amount <= sizeof(Chunk))
+        for(CachedBlock* block = cache->bins[index]; block != NULL; block = block->next, blocks++)
         {
-            if(current->next->isFree) {
-                int32_t newSize = current->size - amount + current->next->size;
-                current->size = amount;
-                Chunk* newChunk = (uchar*)current + sizeof(Chunk) + current->size;
-                newChunk->next = current->next->next;
-                newChunk->next->prev = newChunk;
-                newChunk->prev = current;
-                newChunk->size = newSize;
-                current->next = newChunk;
-                newChunk->isFree = true;
-                newChunk->debugParams.fileName = NULL;
-                current->debugParams.lineNumber = fileline;
-                current->debugParams.fileName = filename;
-                setFences(1, newChunk);
-                setSum(3, current, newChunk, newChunk->next);
-                updateChunksCount();
-            }
-            return memblock;
-        } else
-        {
-            splitChunk(current, amount);
-            current->isFree = false;
-            if(current->next->next->isFree){
-                mergeChunks(current->next, current->next->next);
-            }
-            current->debugParams.lineNumber = fileline;
-            current->debugParams.fileName = filename;
-            setSum(1, current);
-            updateChunksCount();
-            return memblock;
+            Chunk* chunk = (Chunk*)block - 1;
+            Arena* arena = sharedArenaOf(block);
+            if(blocks >= cache->cachedBlocks || arena == NULL || chunk <= arena->heap.head)
+                return printf("%s : Thread cache bin[%u] points outside of heap\n", __f, index), -1;
+#ifdef HEAP_CHUNK_DEBUG
+            if(chunkDebug(chunk)->firstFence != RANDOM_FENCE_VALUE || chunkDebug(chunk)->secondFence != RANDOM_FENCE_VALUE)
+                return printf("%s : Thread cache bin[%u] holds a block with invalid fences\n", __f, index), -1;
+#endif
+            if(chunk->isFree || chunk->size < (index + 1) * sizeof(void*) || block->key != ((uintptr_t)cache ^ RANDOM_FENCE_VALUE))
+                return printf("%s : Thread cache bin[%u] holds an invalid block\n", __f, index), -1;
+            bytes += chunk->size;
         }
+    }
+    if(bytes != cache->cachedBytes || blocks != cache->cachedBlocks)
+        return ConsoleLog(__f, "Thread cache counters don't match cached blocks"), -1;
+    return 0;
+}
 
+size_t heapUsedSpace(Heap* heap)
+{
+    if(heap->isInitialized == false)
+        return 0;
+    return heap->chunksCount.usedBytes;
+}
+size_t heapLargestUsedBlockSize(Heap* heap)
+{
+    if(heap->isInitialized == false)
+        return 0;
+    if(heap->usedSizes.largeMap != 0)
+    {
+        // Every other chunk of the bin takes at least the bin's lower bound out of its bytes
+        int top = highestBin(heap->usedSizes.largeMap);
+        size_t limit = heap->usedSizes.largeBytes[top] - (heap->usedSizes.large[top] - 1) * (SMALL_BIN_LIMIT << top);
+        return largestOf(&heap->usedSizes.largest, top, limit);
     }
-    current->debugParams.lineNumber = fileline;
-    current->debugParams.fileName = filename;
-    setSum(1, current);
-    return memblock;
+    // Small used sizes are only counted, each count stands for one size
+    uint64_t map = heap->usedSizes.smallMap;
+    return map ? (64 - __builtin_clzll(map)) * sizeof(void*) : 0;
 }
-void heap_free_nts(void* memblock)
+size_t heapFreeSpace(Heap* heap)
 {
-    bool exists = chunkExists((Chunk*)((uchar*)memblock-sizeof(Chunk)));
-    if(!exists){
-        ConsoleLog(__f, "Invalid chunk <not exists>");
-        return;
+    if(heap->isInitialized == false)
+        return 0;
+    return heap->chunksCount.freeBytes;
+}
+size_t heapLargestFreeArea(Heap* heap)
+{
+    if(heap->isInitialized == false)
+        return 0;
+    // Any large free chunk beats small bins and parked chunks
+    if(heap->binsMap[1] != 0 && atomic_load_explicit(&placementPolicy, memory_order_relaxed) != placement_segregated)
+        return treeLast(heap->trees.bySize, TREE_BY_SIZE)->size;
+    if(heap->binsMap[1] != 0)
+    {
+        // A chunk alone in its bin is the largest whether the size is stale or not
+        Chunk* bin = heap->bins[SMALL_BINS_COUNT + highestBin(heap->binsMap[1])];
+        if(bin->nextFree == NULL)
+            return bin->size;
+        return largestOf(&heap->largestFree, highestBin(heap->binsMap[1]), heap->chunksCount.freeBytes);
     }
-    Chunk* chunk = (Chunk*)((uchar*)memblock-sizeof(Chunk));
-    Chunk* temp = chunk;
-    if(chunk->isFree == true)
+    // Small bins hold one size each, the highest non-empty one holds the largest
+    size_t max = heap->binsMap[0] ? (size_t)heap->bins[63 - __builtin_clzll(heap->binsMap[0])]->size : 0;
+    for(int index = QUICK_LISTS_COUNT - 1; index >= 0 && heap->quick.bytes != 0; --index)
     {
-        ConsoleLog(__f, "Double free deteched");
-        return;
+        if(heap->quick.lists[index] != NULL)
+            return (size_t)heap->quick.lists[index]->size > max ? (size_t)heap->quick.lists[index]->size : max;
+    }
+    return max;
+}
+
+// Statistics cover the default arena and the arenas threads are spread over. Counters are read
+// from what each arena and the large block table published, so pollers never take a lock. Blocks
+// in thread caches are still used to their arenas and count as used, as they do in heap_get_stats
+size_t heap_get_used_space(void) {
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    size_t space = 0;
+    for(unsigned int i = 0; i < count; ++i)
+    {
+        ArenaStats stats;
+        statsRead(&arenas[i]->stats, &stats);
+        space += stats.usedBytes;
+    }
+    size_t largeBytes, largest;
+    uint64_t largeCount;
+    largeBlocksUsage(&largeBytes, &largeCount, &largest);
+    return space + largeBytes;
+}
+size_t heap_get_largest_used_block_size(void)
+{
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    size_t max = 0;
+    for(unsigned int i = 0; i < count; ++i)
+    {
+        ArenaStats stats;
+        statsRead(&arenas[i]->stats, &stats);
+        if(stats.largestUsed > max)
+            max = stats.largestUsed;
     }
-    if(chunk->next->isFree){
-        mergeChunks(chunk, chunk->next);
-        setSum(2, chunk, chunk->next);
+    size_t largeBytes, largest;
+    uint64_t largeCount;
+    largeBlocksUsage(&largeBytes, &largeCount, &largest);
+    return largest > max ? largest : max;
+}
+uint64_t heap_get_used_blocks_count(void)
+{
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    uint64_t blocks = 0;
+    for(unsigned int i = 0; i < count; ++i)
+    {
+        ArenaStats stats;
+        statsRead(&arenas[i]->stats, &stats);
+        blocks += stats.usedChunks;
     }
-    if(chunk->prev->isFree){
-        temp = chunk->prev;
-        mergeChunks(chunk->prev, chunk);
-        setSum(2, temp, temp->next);
+    size_t largeBytes, largest;
+    uint64_t largeCount;
+    largeBlocksUsage(&largeBytes, &largeCount, &largest);
+    return blocks + largeCount;
+}
+size_t heap_get_free_space(void)
+{
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    size_t size = 0;
+    for(unsigned int i = 0; i < count; ++i)
+    {
+        ArenaStats stats;
+        statsRead(&arenas[i]->stats, &stats);
+        size += stats.freeBytes;
     }
-    if(!temp->isFree){
-        temp->isFree = true;
+    return size;
+}
+size_t heap_get_largest_free_area(void)
+{
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    size_t max = 0;
+    for(unsigned int i = 0; i < count; ++i)
+    {
+        ArenaStats stats;
+        statsRead(&arenas[i]->stats, &stats);
+        if(stats.largestFree > max)
+            max = stats.largestFree;
     }
-    setSum(1, chunk);
-    updateChunksCount();
+    return max;
 }
-
-Chunk* findAligned(size_t size)
+uint64_t heap_get_free_gaps_count(void)
 {
-    if(heap.isInitialized==false)
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    uint64_t gaps = 0;
+    for(unsigned int i = 0; i < count; ++i)
     {
-        ConsoleLog(__f, "Heap isn't initialized");
-        return NULL;
+        ArenaStats stats;
+        statsRead(&arenas[i]->stats, &stats);
+        gaps += stats.freeChunks;
     }
+    return gaps;
+}
 
-    Chunk* current = heap.head->next;
-
-    while(current != heap.tail)
-    {
-        if(current->isFree == true) {
-            intptr_t dataStart = (uchar *) current + sizeof(Chunk);
-            if (dataStart % PAGE_SIZE == 0 && size <= current->size) {
-                if (size == current->size || current->size - size <= sizeof(Chunk)){
-                    current->isFree = false;
-                    updateChunksCount();
-                    return current;
-                }
-                else
-                {
-                    splitChunk(current, size);
 
-                    current->isFree = false;
-                    updateChunksCount();
-                    return current;
-                }
-            }
-            else if (size <= current->size) {
-                intptr_t memoryStart = alignedMemory(dataStart, dataStart + current->size);
-                if (memoryStart == 0)
-                {
-                    current = current->next;
-                    continue;
-                }
-                else if (memoryStart + size + sizeof(Chunk) < dataStart + current->size)
-                {
-                    splitChunk(current, memoryStart - dataStart - sizeof(Chunk));
-                    current->next->isFree = false;
-                    if(current->next->size - size > sizeof(Chunk)) {
-                        splitChunk(current->next, size);
-                        updateChunksCount();
-                    }
-                    current->next->isFree = false;
-                    setSum(1, current->next);
-                    updateChunksCount();
-                    return current->next;
-                }
-                else
-                {
-                    current = current->next;
-                    continue;
-                }
-            }
-        }
-        current = current->next;
+enum pointer_type_t heapPointerType(Heap* heap, const void* pointer)
+{
+    if(pointer == NULL)
+        return pointer_null;
+    if(heap->isInitialized == false)
+        return pointer_out_of_heap;
+    intptr_t ptr = (intptr_t)pointer;
+    if(ptr < (intptr_t)heap->head || ptr > heap->tail)
+        return pointer_out_of_heap;
+    Chunk* temp = chunkMapFind(heap, pointer);
+    if(ptr < (intptr_t)(temp+1))
+        return pointer_control_block;
+    if(temp->isSlab && temp->isFree == false)
+    {
+        // Slab header is control data, slots are blocks of their own
+        Slab* slab = (Slab*)(temp+1);
+        if(ptr < (intptr_t)(slab+1))
+            return pointer_control_block;
+        uintptr_t offset = ptr - (intptr_t)(slab+1);
+        uintptr_t slot = offset / slab->slotSize;
+        if(slot >= slab->slotsCount || (slab->usedMap[slot / 64] & (1ULL << (slot % 64))) == 0)
+            return pointer_unallocated;
+        return (offset % slab->slotSize == 0) ? pointer_valid : pointer_inside_data_block;
     }
-    return NULL;
+    if(temp->isFree || temp->isQuick)
+        return pointer_unallocated;
+    return (ptr == (intptr_t)(temp+1)) ? pointer_valid : pointer_inside_data_block;
 }
-intptr_t alignedMemory(intptr_t start, intptr_t end)
+enum pointer_type_t get_pointer_type(const void* pointer)
 {
-    intptr_t memory = start - start % PAGE_SIZE + PAGE_SIZE;
-    if(memory >= start && memory < end)
-        return memory;
-    return 0;
+    if(pointer == NULL)
+        return pointer_null;
+    Arena* arena = arenaOf(pointer);
+    pthread_mutex_lock(&arena->mutex);
+    enum pointer_type_t type = heapPointerType(&arena->heap, pointer);
+    pthread_mutex_unlock(&arena->mutex);
+    if(type == pointer_out_of_heap)
+        type = largePointerType(pointer);
+    return type;
 }
-void* heap_malloc_aligned_nts_debug(size_t count, int fileline, const char* filename)
+
+size_t heap_get_block_size(const void* memblock)
 {
-    if(!heap.isInitialized){
-        ConsoleLog(__f, "Heap isn't initialized");
+    if(memblock == NULL)
+        return 0;
+    size_t size = largeBlockSize(memblock);
+    if(size != 0)
+        return size;
+    Arena* arena = arenaOf(memblock);
+    pthread_mutex_lock(&arena->mutex);
+    if(arena->heap.isInitialized == false)
+        return pthread_mutex_unlock(&arena->mutex), 0;
+    enum pointer_type_t ptr = heapPointerType(&arena->heap, memblock);
+    Slab* slab = slabOf(&arena->heap, memblock);
+    if(slab != NULL)
+        return pthread_mutex_unlock(&arena->mutex), (ptr==pointer_valid) ? slab->slotSize : 0;
+    Chunk* temp = (Chunk*)((uchar*)memblock-sizeof(Chunk));
+    return pthread_mutex_unlock(&arena->mutex), (ptr==pointer_valid) ? temp->size : 0;
+}
+
+void* heap_get_data_block_start(const void* pointer)
+{
+    if(pointer == NULL)
         return NULL;
+    void* memory = largeBlockStart(pointer);
+    if(memory != NULL)
+        return memory;
+    Arena* arena = arenaOf(pointer);
+    Heap* heap = &arena->heap;
+    pthread_mutex_lock(&arena->mutex);
+    if(heap->isInitialized == false)
+        return pthread_mutex_unlock(&arena->mutex), NULL;
+    enum pointer_type_t ptr = heapPointerType(heap, pointer);
+    if(ptr == pointer_valid)
+        return pthread_mutex_unlock(&arena->mutex), pointer;
+    if(ptr != pointer_inside_data_block)
+        return pthread_mutex_unlock(&arena->mutex), NULL;
+    Slab* slab = slabOf(heap, pointer);
+    if(slab != NULL)
+    {
+        uintptr_t offset = (uchar*)pointer - (uchar*)(slab+1);
+        return pthread_mutex_unlock(&arena->mutex), (uchar*)(slab+1) + offset - offset % slab->slotSize;
     }
-    if(!count)
+    Chunk* temp = chunkMapFind(heap, pointer);
+    return pthread_mutex_unlock(&arena->mutex), temp+1;
+}
+
+int heapValidateFields(Heap* heap)
+{
+    // HEAP ISN'T INITIALIZED
+    if(heap->isInitialized == false)
+        return -1;
+    // MISSING GUARDS
+    if(heap->chunksCount.used < 2){
+        return ConsoleLog(__f, "Missing guards in heap"), -1;
+    }
+    // BOUNDARIES DON'T EQUAL TAIL AND HEAD
+    if(heap->boundaries.leftBound != heap->head || heap->boundaries.rightBound != heap->tail)
     {
-        ConsoleLog(__f, "Invalid count");
-        return NULL;
+        return ConsoleLog(__f, "head != boundary.left || tail != boundary.right"), -1;
     }
-    size_t allocateSize = ceilWord(count);
-    Chunk* chunk = findAligned(allocateSize);
-    intptr_t pagesToReturn = 0;
-    if(chunk == NULL)
+    // INVALID FENCES
+    if(heap->firstFence != RANDOM_FENCE_VALUE || heap->secondFence != RANDOM_FENCE_VALUE)
     {
-        while(true)
-        {
-            int err = getSpace(1);
-            if(err != 1)
-            {
-                ConsoleLog(__f, "custom_sbrk failed");
-                heap.tail->prev->size -= pagesToReturn*PAGE_SIZE;
-                Chunk* temp = heap.tail->prev;
-                heap.tail = heap.boundaries.rightBound = (Chunk*)(heap.tail->prev->size + (uchar*)heap.tail->prev + sizeof(chunk));
-                heap.tail->prev = temp;
-                heap.tail->next = NULL;
-                temp->next = heap.tail;
-                custom_sbrk(-pagesToReturn*PAGE_SIZE);
-                return NULL;
-            }
-            pagesToReturn++;
-            chunk = findAligned(allocateSize);
-            if(chunk != NULL)
-            {
-                setSum(1, heap.tail);
-                break;
-            }
-        }
+        return ConsoleLog(__f, "heap.fences != RANDOM_FENCE_VALUE"), -1;
     }
-    setFences(1, chunk);
-    chunk->debugParams.lineNumber = fileline;
-    chunk->debugParams.fileName = filename;
-    setSum(1, chunk);
-    updateChunksCount();
-    return (uchar*)chunk + sizeof(Chunk);
+#ifdef HEAP_CHECKSUM
+    // HEAPSUM INVALID
+    int32_t sum = heap->sumOfBytes;
+    heapSetSum(heap);
+    if(sum != heap->sumOfBytes){
+        return ConsoleLog(__f, "Control sum is invalid"), -1;
+    }
+#endif
+    if(heap->boundaries.leftBound != heap->head || heap->boundaries.rightBound != heap->tail)
+    {
+        return ConsoleLog(__f, "Boundaries are damaged or badly set <boundaries != head&tail>"), -1;
+    }
+    return 0;
 }
-void* heap_realloc_aligned_nts_debug(void* memblock, size_t size, int fileline, const char* filename)
+int chunkValidate(Heap* heap, Chunk* current, int blockID)
 {
-    if(heap.isInitialized == false) {
-        ConsoleLog(__f, "Heap doesn't exists");
-        return NULL;
+    if(current->isQuick && (current->isFree || current->isSlab || current->size > QUICK_LIST_MAX_SIZE))
+    {
+        return printf("%s : Block[%i] is parked but isn't a small used chunk\n", __f, blockID), -1;
     }
-    if(memblock == NULL)
-        return heap_malloc_aligned_nts_debug(size, fileline, filename);
-    if(size == 0)
-        return heap_free_nts(memblock), NULL;
-    Chunk* current = (Chunk*)((uchar*)memblock - sizeof(Chunk));
-     if((intptr_t)memblock % PAGE_SIZE != 0)
+    if(!chunkMapTest(heap, current))
     {
-        void* newChunk = heap_malloc_aligned_nts_debug(size, fileline, filename);
-        if(newChunk == NULL)
-        {
-            ConsoleLog(__f, "Malloc failed");
-            return NULL;
-        }
-        Chunk* temp = (Chunk*)((uchar*)newChunk - sizeof(Chunk));
-        memcpy(newChunk, memblock, temp->size);
-        temp->isFree = false;
-        heap_free_nts(memblock);
-        setSum(1, temp);
-        return newChunk;
+        return printf("%s : Block[%i] is missing from chunk map\n", __f, blockID), -1;
     }
-    size_t amount = ceilWord(size);
-    size_t sizeWithNext = current->size + sizeof(Chunk) + current->next->size;
-    intptr_t left = (intptr_t)sizeWithNext-(intptr_t)amount;
-    if(current->size == amount){
-        current->debugParams.lineNumber =fileline;
-        current->debugParams.fileName = filename;
-        setSum(1, current);
-        return memblock;
+    if(current->isSlab && !current->isFree && slabValidate(heap, current) != 0)
+    {
+        return printf("%s : Block[%i] holds a damaged slab\n", __f, blockID), -1;
     }
-    else if(current->size < amount)
+    //PROBLEMS WITH TAIL AND HEAD
+    if(current == heap->tail && current->next != NULL)
     {
-        if(current->next->isFree && left==0)
+        return ConsoleLog(__f, "tail->next != NULL"), -1;
+    }
+    if(current == heap->head && current->prev != NULL)
+    {
+        return ConsoleLog(__f, "head->prev != NULL"), -1;
+    }
+    if(current != heap->tail && current->next == NULL)
+    {
+        return printf("%s : Block[%i]->next == NULL\n", __f,  blockID, blockID), -1;
+    }
+    if(current != heap->head && current->prev == NULL)
+    {
+        return printf("%s : Block[%i]->prev == NULL\n", __f,  blockID, blockID), -1;
+    }
+    if(current != heap->tail && current->next->prev != current)
+    {
+        return printf("%s : Block[%i]->next->prev != Block[%i]\n", __f,  blockID, blockID), -1;
+    }
+    if(current != heap->head && current->prev->next != current)
+    {
+        return printf("%s : Block[%i]->prev->next != Block[%i]\n", __f,  blockID, blockID), -1;
+    }
+    if((intptr_t)current % sizeof(void*) != 0)
+    {
+        return printf("%s : Block[%i] has invalid address <address mod word>\n", __f, blockID), -1;
+    }
+    if(current != heap->tail && (intptr_t)current->next % sizeof(void*) != 0)
+    {
+        return printf("%s : Block[%i] has invalid address <address mod word>\n", __f, blockID+1), -1;
+    }
+    if(current != heap->head && (intptr_t)current->prev % sizeof(void*) != 0)
+    {
+        return printf("%s : Block[%i] has invalid address <address mod word>\n", __f, blockID-1), -1;
+    }
+#ifdef HEAP_CHECKSUM
+    // INVALID SIZE
+    int32_t size = current->size;
+    int32_t check = chunkDebug(current)->sumOfBytes;
+    setSum(1, current);
+    if(size != current->size)
+    {
+        return printf("%s : Block[%i] has invalid size\n", __f, blockID), -1;
+    }
+#endif
+#ifdef HEAP_CHUNK_DEBUG
+    // INVALID FENCES VALUE
+    if(chunkDebug(current)->firstFence != RANDOM_FENCE_VALUE || chunkDebug(current)->secondFence != RANDOM_FENCE_VALUE)
+    {
+        return printf("%s : Block[%i] has invalid fences value\n", __f, blockID), -1;
+    }
+#endif
+    // INVALID SIZE
+    if(current->size % sizeof(void*) != 0)
+    {
+        return printf("%s : Block[%i] has invalid size <size mod sizeof(void*)>\n", __f, blockID), -1;
+    }
+#ifdef HEAP_CHECKSUM
+    // INVALID CONTROL SUM
+    if(check != chunkDebug(current)->sumOfBytes)
+    {
+        return printf("%s : Block[%i] has invalid control sum\n", __f, blockID), -1;
+    }
+#endif
+    // BROKEN FREE LINKS
+    if(current->isFree && ((current->prevFree == NULL) != (heap->bins[binIndex(current->size)] == current) ||
+                           (current->nextFree != NULL && current->nextFree->prevFree != current)))
+    {
+        return printf("%s : Block[%i] has broken free links\n", __f, blockID), -1;
+    }
+    return 0;
+}
+int heapValidate(Heap* heap)
+{
+    if(heapValidateFields(heap) != 0)
+        return -1;
+    // INVALID CHUNKS
+    int blockID = 0;
+    uint32_t freeChunks = 0;
+    size_t freeBytes = 0;
+    uint32_t quickChunks = 0;
+    uint32_t usedSmall[SMALL_BINS_COUNT] = {0};
+    uint32_t usedLarge[LARGE_BINS_COUNT] = {0};
+    size_t usedLargeBytes[LARGE_BINS_COUNT] = {0};
+    size_t largestUsed = 0, largestFree = 0;
+    uint32_t largestUsedCount = 0, largestFreeCount = 0;
+    for(Chunk* current = heap->head; current != NULL; current = current->next, blockID++)
+    {
+        if(current->isFree || current->isQuick)
         {
-            mergeChunks(current, current->next);
-            current->isFree = false;
-            // dodane
-            current->debugParams.lineNumber =fileline;
-            current->debugParams.fileName = filename;
-            setSum(1, current);
-            updateChunksCount();
-            return memblock;
+            freeChunks++;
+            freeBytes += current->size;
         }
-        else if(current->next->isFree && left < 0)
+        else if(current != heap->head && current != heap->tail)
         {
-            // wprowadzam ;eksperymenty
-            void* newChunk = heap_malloc_aligned_nts_debug(amount, fileline, filename);
-            if(newChunk == NULL)
+            if(binIndex(current->size) < SMALL_BINS_COUNT)
+                usedSmall[binIndex(current->size)]++;
+            else
             {
-                ConsoleLog(__f, "Malloc couldn't allocate memory");
-                return NULL;
+                usedLarge[binIndex(current->size) - SMALL_BINS_COUNT]++;
+                usedLargeBytes[binIndex(current->size) - SMALL_BINS_COUNT] += current->size;
+            }
+            if((size_t)current->size == largestUsed)
+                largestUsedCount++;
+            else if((size_t)current->size > largestUsed)
+            {
+                largestUsed = current->size;
+                largestUsedCount = 1;
             }
-            memcpy(newChunk, memblock, current->size);
-            Chunk* temp = (Chunk*)((uchar*)newChunk - sizeof(Chunk));
-            temp->isFree = false;
-            heap_free_nts(memblock);
-            return newChunk;
         }
-        else if(current->next->isFree && left > 0)
+        quickChunks += current->isQuick;
+        if(chunkValidate(heap, current, blockID) != 0)
+            return -1;
+    }
+    // INVALID BINS
+    uint32_t binnedChunks = 0;
+    uint32_t histogram[FREE_HISTOGRAM_BUCKETS] = {0};
+    for(unsigned int index = 0; index < BINS_COUNT; ++index)
+    {
+        bool mapped = (heap->binsMap[index / 64] & (1ULL << (index % 64))) != 0;
+        if(mapped != (heap->bins[index] != NULL))
         {
-            mergeChunks(current, current->next);
-            if(left > sizeof(Chunk)){
-                splitChunk(current, amount);
-            }
-            current->isFree = false;
-            updateChunksCount();
-            current->debugParams.fileName = filename;
-            current->debugParams.lineNumber = fileline;
-            setSum(1, current);
-            return memblock;
+            return printf("%s : Bin[%u] doesn't match bins map\n", __f, index), -1;
         }
-        else if(current->next->isFree == false)
+        for(Chunk* current = heap->bins[index]; current != NULL; current = current->nextFree, binnedChunks++)
         {
-            void* newChunk = heap_malloc_aligned_nts_debug(amount, fileline, filename);
-            if(newChunk == NULL)
+            if(binnedChunks >= freeChunks || !current->isFree || binIndex(current->size) != index)
             {
-                ConsoleLog(__f, "Malloc couldn't allocate memory");
-                return NULL;
+                return printf("%s : Bin[%u] holds a chunk which isn't free or doesn't fit\n", __f, index), -1;
             }
-            memcpy(newChunk, memblock, current->size);
-            Chunk* temp = (Chunk*)((uchar*)newChunk - sizeof(Chunk));
-            temp->isFree = false;
-            temp->debugParams.fileName = filename;
-            temp->debugParams.lineNumber = fileline;
-            setSum(1, temp);
-            heap_free_nts(memblock);
-            return newChunk;
+            if((current == heap->bins[index] && current->prevFree != NULL) || (current->nextFree != NULL && current->nextFree->prevFree != current))
+            {
+                return printf("%s : Bin[%u] has broken links\n", __f, index), -1;
+            }
+            histogram[histogramBucket(current->size)]++;
+            if((size_t)current->size == largestFree)
+                largestFreeCount++;
+            else if((size_t)current->size > largestFree)
+            {
+                largestFree = current->size;
+                largestFreeCount = 1;
+            }
+        }
+    }
+    // INVALID QUICK LISTS
+    size_t quickBytes = 0;
+    uint32_t listedChunks = 0;
+    for(unsigned int index = 0; index < QUICK_LISTS_COUNT; ++index)
+    {
+        for(Chunk* current = heap->quick.lists[index]; current != NULL; current = current->nextFree, listedChunks++)
+        {
+            if(listedChunks >= quickChunks || !chunkExists(heap, current) || !current->isQuick || current->size != (index + 1) * sizeof(void*))
+            {
+                return printf("%s : Quick list[%u] holds a chunk which isn't parked or doesn't fit\n", __f, index), -1;
+            }
+            quickBytes += current->size;
+            histogram[histogramBucket(current->size)]++;
         }
     }
-    else
+    if(listedChunks != quickChunks || quickBytes != heap->quick.bytes)
     {
-        if(current->size - amount <= sizeof(Chunk))
+        return ConsoleLog(__f, "Quick lists don't match parked chunks"), -1;
+    }
+    if(binnedChunks + quickChunks != freeChunks)
+    {
+        return ConsoleLog(__f, "Free chunks are missing from bins"), -1;
+    }
+    if(memcmp(histogram, heap->freeHistogram, sizeof(histogram)) != 0)
+    {
+        return ConsoleLog(__f, "Free histogram doesn't match bins"), -1;
+    }
+    // INVALID TREES
+    if(atomic_load_explicit(&placementPolicy, memory_order_relaxed) != placement_segregated)
+    {
+        int64_t largeChunks = 0;
+        for(unsigned int index = SMALL_BINS_COUNT; index < BINS_COUNT; ++index)
+            for(Chunk* current = heap->bins[index]; current != NULL; current = current->nextFree)
+                largeChunks++;
+        if(treeValidate(heap, heap->trees.bySize, TREE_BY_SIZE, NULL, NULL) != largeChunks ||
+           treeValidate(heap, heap->trees.byAddress, TREE_BY_ADDRESS, NULL, NULL) != largeChunks)
         {
-            if(current->next->isFree) {
-                size_t newBlockSize = current->size - amount + current->next->size;
-                Chunk *newBlock = (uchar *) current + sizeof(Chunk) + amount;
-                current->size = amount;
-                newBlock->next = current->next->next;
-                newBlock->prev = current;
-                newBlock->size = newBlockSize;
-                newBlock->isFree = true;
-                newBlock->debugParams.fileName = NULL;
-                current->next = newBlock;
-                setSum(2, current, current->next);
-                setFences(1, current->next);
-            }
-            current->debugParams.lineNumber =fileline;
-            current->debugParams.fileName = filename;
-            setSum(1, current);
-            return memblock;
-        } else
+            return ConsoleLog(__f, "Free trees don't match large bins"), -1;
+        }
+    }
+    else if(heap->binsMap[1] != 0 && largestValidate(&heap->largestFree, largestFree, largestFreeCount) != 0)
+    {
+        return ConsoleLog(__f, "Largest free size doesn't match large bins"), -1;
+    }
+    // INVALID USED SIZES
+    if(usedSizesValidate(heap, usedSmall, usedLarge, usedLargeBytes) != 0)
+        return -1;
+    if(heap->usedSizes.largeMap != 0 && largestValidate(&heap->usedSizes.largest, largestUsed, largestUsedCount) != 0)
+    {
+        return ConsoleLog(__f, "Largest used size doesn't match used bins"), -1;
+    }
+    // INVALID SLABS
+    for(unsigned int index = 0; index < SLAB_CLASSES; ++index)
+    {
+        for(Slab* slab = heap->slabs[index]; slab != NULL; slab = slab->next)
         {
-            splitChunk(current, amount);
-            current->isFree = false;
-            if(current->next->next->isFree){
-                mergeChunks(current->next, current->next->next);
+            Chunk* chunk = (Chunk*)slab - 1;
+            if(!chunkExists(heap, chunk) || !chunk->isSlab || chunk->isFree || slab->slotSize != (index + 1) * sizeof(void*))
+            {
+                return printf("%s : Slab list[%u] holds an invalid slab\n", __f, index), -1;
             }
-            updateChunksCount();
-            current->debugParams.lineNumber =fileline;
-            current->debugParams.fileName = filename;
-            setSum(1, current);
-            return memblock;
         }
-
-    }
-    return memblock;
-}
-void* heap_calloc_aligned_nts_debug(size_t number, size_t size, int fileline, const char* filename)
-{
-    if(SIZE_MAX / size < number){
-        ConsoleLog(__f, "Overflow");
-        return NULL;
     }
-    void* start = heap_malloc_aligned_nts_debug(size * number, fileline, filename);
-    if(start == NULL){
-        ConsoleLog(__f, "Couldn't allocate memory");
-        return NULL;
+    // INVALID CHUNK MAP
+    uintptr_t lastWord = ((uintptr_t)heap->tail - (uintptr_t)((Arena*)heap)->base) / sizeof(void*) / 64;
+    uint64_t mappedChunks = 0;
+    for(uintptr_t index = 0; index <= lastWord; ++index)
+        mappedChunks += __builtin_popcountll(heap->chunkMap[index]);
+    if(mappedChunks != blockID)
+    {
+        return ConsoleLog(__f, "Chunk map doesn't match the heap"), -1;
     }
-    memset(start, 0, size*number);
-    return start;
-}
-
-size_t heap_get_used_space(void) {
-    pthread_mutex_lock(&mutex);
-    if(heap.isInitialized == false)
+    // INVALID COUNTERS
+    if(heap->chunksCount.free != freeChunks || heap->chunksCount.used != blockID - freeChunks)
     {
-        pthread_mutex_unlock(&mutex);
-        return 0;
+        return ConsoleLog(__f, "Chunks count doesn't match the heap"), -1;
     }
-    Chunk* current = heap.head->next;
-    size_t space = 0;
-    while(current != heap.tail)
+    if(heap->chunksCount.freeBytes != freeBytes || heap->chunksCount.usedBytes + freeBytes != (uchar*)(heap->tail + 1) - (uchar*)heap->head)
     {
-        if(current->isFree == false)
-            space+=current->size;
-        space += sizeof(Chunk);
-        current = current->next;
+        return ConsoleLog(__f, "Free and used bytes don't match the heap"), -1;
     }
-    space += 2 * sizeof(Chunk);
-    return pthread_mutex_unlock(&mutex), space;
+    return 0;
 }
-size_t heap_get_largest_used_block_size(void)
+size_t heap_trim(size_t keep)
 {
-    pthread_mutex_lock(&mutex);
-    if(heap.isInitialized == false)
-        return pthread_mutex_unlock(&mutex), 0;
-    if(heap.chunksCount.used == 2)
+    if(defaultArena.heap.isInitialized == false)
         return 0;
-    size_t max = 0;
-    for(Chunk* current = heap.head->next; current != heap.tail; current=current->next)
+    size_t released = 0;
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    for(unsigned int i = 0; i < count; ++i)
+    {
+        pthread_mutex_lock(&arenas[i]->mutex);
+        heapDrainRemote(&arenas[i]->heap);
+        released += heapTrim(&arenas[i]->heap, keep);
+        arenaUnlock(arenas[i]);
+    }
+    pthread_mutex_lock(&arenasMutex);
+    for(Arena* arena = privateArenas; arena != NULL; arena = arena->next)
     {
-        if(current->isFree == false && current->size > max)
-            max = current->size;
+        pthread_mutex_lock(&arena->mutex);
+        released += heapTrim(&arena->heap, keep);
+        arenaUnlock(arena);
     }
-    return pthread_mutex_unlock(&mutex), max;
+    pthread_mutex_unlock(&arenasMutex);
+    return released;
 }
-uint64_t heap_get_used_blocks_count(void)
+size_t heap_profile_get(struct heap_profile_site_t* sites, size_t capacity)
 {
-    pthread_mutex_lock(&mutex);
-    if(heap.isInitialized == false)
-        return pthread_mutex_unlock(&mutex), 0;
-    return pthread_mutex_unlock(&mutex), heap.chunksCount.used;
+    // Returns the number of sites, only the first capacity of them are copied
+    size_t count = 0;
+    pthread_mutex_lock(&profileMutex);
+    double elapsed = profileStart ? (profileNow() - profileStart) / 1e9 : 0;
+    for(size_t i = 0; i < PROFILE_SITES; ++i)
+    {
+        ProfileSite* site = &profileSites[i];
+        if(!site->isUsed)
+            continue;
+        if(sites != NULL && count < capacity)
+        {
+            sites[count].fileName = site->fileName;
+            sites[count].lineNumber = site->lineNumber;
+            sites[count].liveBytes = site->liveBytes;
+            sites[count].allocations = site->allocations;
+            sites[count].allocatedBytes = site->allocatedBytes;
+            sites[count].bytesPerSecond = elapsed > 0 ? site->allocatedBytes / elapsed : 0;
+            sites[count].averageLifetime = site->freedSamples ? site->lifetimeNs / 1e9 / site->freedSamples : 0;
+        }
+        count++;
+    }
+    pthread_mutex_unlock(&profileMutex);
+    return count;
 }
-size_t heap_get_free_space(void)
+int heap_profile_dump(const char* path)
 {
-    pthread_mutex_lock(&mutex);
-    if(heap.isInitialized == false)
-        return pthread_mutex_unlock(&mutex), 0;
-    size_t size = 0;
-    for(Chunk* current = heap.head->next; current != heap.tail; current=current->next)
+    size_t count = heap_profile_get(NULL, 0);
+    // The copy can't come from the heap it describes
+    size_t bytes = (count ? count : 1) * sizeof(struct heap_profile_site_t);
+    struct heap_profile_site_t* sites = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(sites == MAP_FAILED)
     {
-        if(current->isFree)
-            size += current->size;
+        ConsoleLog(__f, "Couldn't map memory for the profile");
+        return -1;
+    }
+    size_t total = heap_profile_get(sites, count);
+    if(total < count)
+        count = total;
+    qsort(sites, count, sizeof(struct heap_profile_site_t), compareProfileSites);
+    FILE* file = fopen(path, "w");
+    if(file == NULL)
+    {
+        munmap(sites, bytes);
+        ConsoleLog(__f, "Couldn't open the dump file");
+        return -1;
     }
-    return pthread_mutex_unlock(&mutex), size;
+    fprintf(file, "%-32s %6s %14s %14s %16s %14s %12s\n", "file", "line", "live bytes", "allocations", "allocated bytes", "bytes/s", "lifetime s");
+    for(size_t i = 0; i < count; ++i)
+        fprintf(file, "%-32s %6d %14zu %14llu %16llu %14.0f %12.6f\n", sites[i].fileName ? sites[i].fileName : "<unknown>", sites[i].lineNumber,
+                sites[i].liveBytes, (unsigned long long)sites[i].allocations, (unsigned long long)sites[i].allocatedBytes,
+                sites[i].bytesPerSecond, sites[i].averageLifetime);
+    int status = fclose(file) == 0 ? 0 : -1;
+    munmap(sites, bytes);
+    return status;
 }
-size_t heap_get_largest_free_area(void)
+int heap_trace_start(int fd)
 {
-    pthread_mutex_lock(&mutex);
-    if(heap.isInitialized == false)
-        return pthread_mutex_unlock(&mutex), 0;
-    size_t max = 0;
-    for(Chunk* current = heap.head->next; current != heap.tail; current=current->next)
+    pthread_mutex_lock(&traceMutex);
+    if(atomic_load(&traceActive))
+    {
+        pthread_mutex_unlock(&traceMutex);
+        ConsoleLog(__f, "Trace is already running");
+        return -1;
+    }
+    if(!writeAll(fd, HEAP_TRACE_MAGIC, 8))
+    {
+        pthread_mutex_unlock(&traceMutex);
+        ConsoleLog(__f, "Couldn't write the trace");
+        return -1;
+    }
+    // Records that came in after the last stop belong to no trace
+    for(TraceBuffer* buffer = traceBuffers; buffer != NULL; buffer = buffer->next)
     {
-        if(current->isFree == true && current->size > max)
-            max = current->size;
+        pthread_mutex_lock(&buffer->lock);
+        buffer->count = 0;
+        pthread_mutex_unlock(&buffer->lock);
     }
-    return pthread_mutex_unlock(&mutex), max;
+    pthread_mutex_lock(&traceWriteMutex);
+    traceFd = fd;
+    traceFailed = false;
+    pthread_mutex_unlock(&traceWriteMutex);
+    traceStart = profileNow();
+    atomic_store_explicit(&traceActive, true, memory_order_release);
+    pthread_mutex_unlock(&traceMutex);
+    return 0;
 }
-uint64_t heap_get_free_gaps_count(void)
+int heap_trace_stop(void)
 {
-    pthread_mutex_lock(&mutex);
-    if(heap.isInitialized == false)
-        return pthread_mutex_unlock(&mutex), 0;
-    return pthread_mutex_unlock(&mutex), heap.chunksCount.free;
+    pthread_mutex_lock(&traceMutex);
+    if(!atomic_load(&traceActive))
+    {
+        pthread_mutex_unlock(&traceMutex);
+        ConsoleLog(__f, "Trace isn't running");
+        return -1;
+    }
+    atomic_store(&traceActive, false);
+    for(TraceBuffer* buffer = traceBuffers; buffer != NULL; buffer = buffer->next)
+    {
+        pthread_mutex_lock(&buffer->lock);
+        traceFlush(buffer);
+        pthread_mutex_unlock(&buffer->lock);
+    }
+    pthread_mutex_lock(&traceWriteMutex);
+    int status = traceFailed ? -1 : 0;
+    traceFd = -1;
+    pthread_mutex_unlock(&traceWriteMutex);
+    pthread_mutex_unlock(&traceMutex);
+    if(status != 0)
+        ConsoleLog(__f, "Couldn't write the trace");
+    return status;
 }
-
-
-enum pointer_type_t get_pointer_type(const void* pointer)
+int heap_get_stats(struct heap_stats_t* stats)
 {
-    pthread_mutex_lock(&mutex);
-    if(pointer == NULL)
-        return pthread_mutex_unlock(&mutex), pointer_null;
-    if(heap.isInitialized == false)
-        return pthread_mutex_unlock(&mutex), pointer_out_of_heap;
-    intptr_t ptr = (intptr_t)pointer;
-    if(ptr < (intptr_t)heap.head || ptr > heap.tail)
-        return pthread_mutex_unlock(&mutex), pointer_out_of_heap;
-    for(Chunk* temp = heap.head; temp != NULL; temp = temp->next)
+    if(defaultArena.heap.isInitialized == false || stats == NULL)
+    {
+        ConsoleLog(__f, "Heap doesn't exist");
+        return -1;
+    }
+    memset(stats, 0, sizeof(struct heap_stats_t));
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    // Every counter is kept up to date by the arenas, so only the largest free area needs a look at the bins
+    for(unsigned int i = 0; i < count; ++i)
+        pthread_mutex_lock(&arenas[i]->mutex);
+    for(unsigned int i = 0; i < count; ++i)
     {
-        if(ptr - sizeof(Chunk) == temp)
-            return pthread_mutex_unlock(&mutex), (temp->isFree == true) ? pointer_unallocated : pointer_valid;
-        if(ptr >= (intptr_t)temp && ptr < (intptr_t)(temp+1))
-            return pthread_mutex_unlock(&mutex), pointer_control_block;
-        if(temp->isFree && ptr >= (intptr_t)(temp+1) && ptr < (intptr_t)((uchar*)temp+temp->size+sizeof(Chunk)))
-            return pthread_mutex_unlock(&mutex), pointer_unallocated;
-        if(!temp->isFree && ptr >= (intptr_t)(temp+1) && ptr < (intptr_t)((uchar*)temp+temp->size+sizeof(Chunk)))
-            return pthread_mutex_unlock(&mutex), pointer_inside_data_block;
+        Heap* heap = &arenas[i]->heap;
+        if(heap->isInitialized == false)
+            continue;
+        stats->usedSpace += heap->chunksCount.usedBytes;
+        stats->freeSpace += heap->chunksCount.freeBytes;
+        stats->freeBlocks += heap->chunksCount.free;
+        stats->headerBytes += (heap->chunksCount.used + heap->chunksCount.free) * sizeof(Chunk);
+        for(unsigned int bucket = 0; bucket < FREE_HISTOGRAM_BUCKETS; ++bucket)
+            stats->freeHistogram[bucket] += heap->freeHistogram[bucket];
+        size_t largest = heapLargestFreeArea(heap);
+        if(largest > stats->largestFreeArea)
+            stats->largestFreeArea = largest;
     }
-    return pthread_mutex_unlock(&mutex), pointer_out_of_heap;
+    size_t largeBytes, largeLargest;
+    uint64_t largeCount;
+    largeBlocksUsage(&largeBytes, &largeCount, &largeLargest);
+    stats->usedSpace += largeBytes;
+    stats->osBytes = atomic_load(&osBytes);
+    stats->peakOsBytes = atomic_load(&osPeakBytes);
+    for(unsigned int i = 0; i < count; ++i)
+        pthread_mutex_unlock(&arenas[i]->mutex);
+    stats->fragmentation = stats->freeSpace ? 1.0 - (double)stats->largestFreeArea / stats->freeSpace : 0;
+    return 0;
 }
-
-size_t heap_get_block_size(const void* memblock)
+int heap_snapshot(int fd)
 {
-    pthread_mutex_lock(&mutex);
-    if(heap.isInitialized == false || memblock == NULL)
-        return pthread_mutex_unlock(&mutex), 0;
-    enum pointer_type_t ptr = get_pointer_type(memblock);
-    Chunk* temp = (Chunk*)((uchar*)memblock-sizeof(Chunk));
-    return pthread_mutex_unlock(&mutex), (ptr==pointer_valid) ? temp->size : 0;
-}
+    if(defaultArena.heap.isInitialized == false)
+    {
+        ConsoleLog(__f, "Heap doesn't exist");
+        return -1;
+    }
+    SnapshotWriter writer = { .fd = fd };
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    for(unsigned int i = 0; i < count; ++i)
+        snapshotArena(&writer, arenas[i], i);
+    // Private arenas are written out pinned, without arenasMutex, so frees looking them up don't wait on the fd
+    pthread_mutex_lock(&arenasMutex);
+    Arena* arena = privateArenas;
+    if(arena != NULL)
+        arena->pins++;
+    pthread_mutex_unlock(&arenasMutex);
+    while(arena != NULL)
+    {
+        snapshotArena(&writer, arena, count++);
+        pthread_mutex_lock(&arenasMutex);
+        Arena* next = arena->next;
+        if(next != NULL)
+            next->pins++;
+        arena->pins--;
+        pthread_mutex_unlock(&arenasMutex);
+        arena = next;
+    }
+    snapshotLargeBlocks(&writer);
 
-void* heap_get_data_block_start(const void* pointer)
-{
-    pthread_mutex_lock(&mutex);
-    if(pointer == NULL || heap.isInitialized == false)
-        return pthread_mutex_unlock(&mutex), NULL;
-    enum pointer_type_t ptr = get_pointer_type(pointer);
-    if(ptr == pointer_valid)
-        return pthread_mutex_unlock(&mutex), pointer;
-    if(ptr != pointer_inside_data_block)
-        return pthread_mutex_unlock(&mutex), NULL;
-    intptr_t memory = (intptr_t)pointer;
-    for(Chunk* temp = heap.head->next; temp != heap.tail; temp = temp->next)
+    snapshotWrite(&writer, "{\"type\":\"summary\",\"used_space\":%zu,\"free_space\":%zu,\"used_blocks\":%llu,\"free_gaps\":%llu,\"largest_used\":%zu,\"largest_free\":%zu}\n",
+                  heap_get_used_space(), heap_get_free_space(), (unsigned long long)heap_get_used_blocks_count(),
+                  (unsigned long long)heap_get_free_gaps_count(), heap_get_largest_used_block_size(), heap_get_largest_free_area());
+    snapshotFlush(&writer);
+    if(writer.failed)
     {
-        if(memory >= (intptr_t)(temp+1) && memory < (intptr_t)((uchar*)temp+temp->size+sizeof(Chunk)))
-            return pthread_mutex_unlock(&mutex), temp+1;
+        ConsoleLog(__f, "Couldn't write the snapshot");
+        return -1;
     }
-    return pthread_mutex_unlock(&mutex), NULL;
+    return 0;
 }
-
 int heap_validate(void)
 {
-    pthread_mutex_lock(&mutex);
-    // HEAP ISN'T INITIALIZED
-    if(heap.isInitialized == false)
-        return pthread_mutex_unlock(&mutex), -1;
-    // MISSING GUARDS
-    if(heap.chunksCount.used < 2){
-        pthread_mutex_unlock(&mutex);
-        return ConsoleLog(__f, "Missing guards in heap"), -1;
-    }
-    // BOUNDARIES DON'T EQUAL TAIL AND HEAD
-    if(heap.boundaries.leftBound != heap.head || heap.boundaries.rightBound != heap.tail)
+    if(defaultArena.heap.isInitialized == false)
+        return -1;
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    for(unsigned int i = 0; i < count; ++i)
     {
-        pthread_mutex_unlock(&mutex);
-        return ConsoleLog(__f, "head != boundary.left || tail != boundary.right"), -1;
+        pthread_mutex_lock(&arenas[i]->mutex);
+        int status = heapValidate(&arenas[i]->heap);
+        pthread_mutex_unlock(&arenas[i]->mutex);
+        if(status != 0)
+            return -1;
     }
-    // INVALID FENCES
-    if(heap.firstFence != RANDOM_FENCE_VALUE || heap.secondFence != RANDOM_FENCE_VALUE)
+    pthread_mutex_lock(&arenasMutex);
+    for(Arena* arena = privateArenas; arena != NULL; arena = arena->next)
     {
-        pthread_mutex_unlock(&mutex);
-        return ConsoleLog(__f, "heap.fences != RANDOM_FENCE_VALUE"), -1;
+        pthread_mutex_lock(&arena->mutex);
+        int status = heapValidate(&arena->heap);
+        pthread_mutex_unlock(&arena->mutex);
+        if(status != 0)
+            return pthread_mutex_unlock(&arenasMutex), -1;
     }
-    // HEAPSUM INVALID
-    int32_t sum = heap.sumOfBytes;
-    heapSetSum();
-    if(sum != heap.sumOfBytes){
-        pthread_mutex_unlock(&mutex);
-        return ConsoleLog(__f, "Control sum is invalid"), -1;
+    pthread_mutex_unlock(&arenasMutex);
+    // INVALID THREAD CACHES
+    pthread_mutex_lock(&threadCachesMutex);
+    for(ThreadCache* cache = threadCaches; cache != NULL; cache = cache->next)
+    {
+        pthread_mutex_lock(&cache->lock);
+        int status = threadCacheValidate(cache);
+        pthread_mutex_unlock(&cache->lock);
+        if(status != 0)
+            return pthread_mutex_unlock(&threadCachesMutex), -1;
     }
-    if(heap.boundaries.leftBound != heap.head || heap.boundaries.rightBound != heap.tail)
+    pthread_mutex_unlock(&threadCachesMutex);
+    // INVALID LARGE BLOCKS
+    pthread_mutex_lock(&largeBlocksMutex);
+    int status = largeBlocksValidate();
+    pthread_mutex_unlock(&largeBlocksMutex);
+    if(status != 0)
+        return -1;
+    ConsoleLog(__f, "Heap is valid!");
+    return 0;
+}
+int heap_validate_step(size_t budget)
+{
+    if(defaultArena.heap.isInitialized == false || budget == 0)
     {
-        pthread_mutex_unlock(&mutex);
-        return ConsoleLog(__f, "Boundaries are damaged or badly set <boundaries != head&tail>"), -1;
+        ConsoleLog(__f, budget ? "Heap doesn't exist" : "Invalid budget");
+        return -1;
     }
-
-    // INVALID CHUNKS
-    int blockID = 0;
-    for(Chunk* current = heap.head; current != NULL; current = current->next, blockID++)
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    pthread_mutex_lock(&validatorMutex);
+    ValidatorCursor* cursor = &validatorCursor;
+    if(cursor->arena >= count)
+        *cursor = (ValidatorCursor){ 0 };
+    Arena* arena = arenas[cursor->arena];
+    Heap* heap = &arena->heap;
+    int status = 0;
+    bool arenaDone = true;
+    pthread_mutex_lock(&arena->mutex);
+    if(heap->isInitialized)
+        status = heapValidateFields(heap);
+    // A heap trimmed below the cursor has nothing left to check in this pass
+    if(heap->isInitialized && status == 0 && cursor->resume <= (uintptr_t)heap->tail)
     {
-        //PROBLEMS WITH TAIL AND HEAD
-        if(current == heap.tail && current->next != NULL)
-        {
-            pthread_mutex_unlock(&mutex);
-            return ConsoleLog(__f, "tail->next != NULL"), -1;
-        }
-        if(current == heap.head && current->prev != NULL)
-        {
-            pthread_mutex_unlock(&mutex);
-            return ConsoleLog(__f, "head->prev != NULL"), -1;
-        }
-        if(current != heap.tail && current->next == NULL)
-        {
-            pthread_mutex_unlock(&mutex);
-            return printf("%s : Block[%i]->next == NULL\n", __f,  blockID, blockID), -1;
-        }
-        if(current != heap.head && current->prev == NULL)
-        {
-            pthread_mutex_unlock(&mutex);
-            return printf("%s : Block[%i]->prev == NULL\n", __f,  blockID, blockID), -1;
-        }
-        if(current != heap.tail && current->next->prev != current)
-        {
-            pthread_mutex_unlock(&mutex);
-            return printf("%s : Block[%i]->next->prev != Block[%i]\n", __f,  blockID, blockID), -1;
-        }
-        if(current != heap.head && current->prev->next != current)
-        {
-            pthread_mutex_unlock(&mutex);
-            return printf("%s : Block[%i]->prev->next != Block[%i]\n", __f,  blockID, blockID), -1;
-        }
-        if((intptr_t)current % sizeof(void*) != 0)
-        {
-            pthread_mutex_unlock(&mutex);
-            return printf("%s : Block[%i] has invalid address <address mod word>\n", __f, blockID), -1;
-        }
-        if(current != heap.tail && (intptr_t)current->next % sizeof(void*) != 0)
-        {
-            pthread_mutex_unlock(&mutex);
-            return printf("%s : Block[%i] has invalid address <address mod word>\n", __f, blockID+1), -1;
-        }
-        if(current != heap.head && (intptr_t)current->prev % sizeof(void*) != 0)
-        {
-            pthread_mutex_unlock(&mutex);
-            return printf("%s : Block[%i] has invalid address <address mod word>\n", __f, blockID-1), -1;
-        }
-        // INVALID SIZE
-        int32_t size = current->size;
-        int32_t check = current->sumOfBytes;
-        setSum(1, current);
-        if(size != current->size)
-        {
-            pthread_mutex_unlock(&mutex);
-            return printf("%s : Block[%i] has invalid size\n", __f, blockID), -1;
-        }
-        // INVALID FENCES VALUE
-        if(current->firstFence != RANDOM_FENCE_VALUE || current->secondFence != RANDOM_FENCE_VALUE)
-        {
-            pthread_mutex_unlock(&mutex);
-            return printf("%s : Block[%i] has invalid fences value\n", __f, blockID), -1;
-        }
-        // INVALID SIZE
-        if(current->size % sizeof(void*) != 0)
+        Chunk* current = heap->head;
+        if(cursor->resume == 0)
+            cursor->blockID = 0;
+        else
         {
-            pthread_mutex_unlock(&mutex);
-            return printf("%s : Block[%i] has invalid size <size mod sizeof(void*)>\n", __f, blockID), -1;
+            // Chunks may have split or merged since the last slice, so go on from the first one past the last checked
+            current = chunkMapFind(heap, (void*)cursor->resume);
+            if((uintptr_t)current < cursor->resume)
+                current = current->next;
         }
-        // INVALID CONTROL SUM
-        if(check != current->sumOfBytes)
+        for(size_t checked = 0; current != NULL && checked < budget; ++checked, current = current->next)
         {
-            pthread_mutex_unlock(&mutex);
-            return printf("%s : Block[%i] has invalid control sum\n", __f, blockID), -1;
+            if(chunkValidate(heap, current, cursor->blockID++) != 0)
+            {
+                status = -1;
+                break;
+            }
+            cursor->resume = (uintptr_t)current + 1;
         }
+        arenaDone = current == NULL;
     }
-    pthread_mutex_unlock(&mutex);
-    ConsoleLog(__f, "Heap is valid!");
+    pthread_mutex_unlock(&arena->mutex);
+    // Damage is looked at again from the head of its arena
+    if(status != 0)
+        cursor->resume = 0;
+    bool passDone = false;
+    if(status == 0 && arenaDone)
+    {
+        cursor->arena++;
+        cursor->resume = 0;
+        passDone = cursor->arena >= count;
+        if(passDone)
+            cursor->arena = 0;
+    }
+    pthread_mutex_unlock(&validatorMutex);
+    return status != 0 ? -1 : passDone;
+}
+void* validatorMain(void* arg)
+{
+    pthread_mutex_lock(&validatorThreadMutex);
+    while(validatorRunning)
+    {
+        pthread_mutex_unlock(&validatorThreadMutex);
+        if(heap_validate_step(validatorBudget) < 0)
+            atomic_store(&validatorFailed, true);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(validatorInterval % 1000000) * 1000;
+        deadline.tv_sec += validatorInterval / 1000000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        // heap_validator_stop wakes it up early
+        pthread_mutex_lock(&validatorThreadMutex);
+        if(validatorRunning)
+            pthread_cond_timedwait(&validatorWake, &validatorThreadMutex, &deadline);
+    }
+    pthread_mutex_unlock(&validatorThreadMutex);
+    return arg;
+}
+int heap_validator_start(size_t budget, unsigned int intervalUs)
+{
+    if(defaultArena.heap.isInitialized == false || budget == 0)
+    {
+        ConsoleLog(__f, budget ? "Heap doesn't exist" : "Invalid budget");
+        return -1;
+    }
+    pthread_mutex_lock(&validatorThreadMutex);
+    if(validatorRunning)
+    {
+        pthread_mutex_unlock(&validatorThreadMutex);
+        ConsoleLog(__f, "Validator is already running");
+        return -1;
+    }
+    validatorBudget = budget;
+    validatorInterval = intervalUs;
+    atomic_store(&validatorFailed, false);
+    validatorRunning = true;
+    if(pthread_create(&validatorThread, NULL, validatorMain, NULL) != 0)
+    {
+        validatorRunning = false;
+        pthread_mutex_unlock(&validatorThreadMutex);
+        ConsoleLog(__f, "Couldn't start the validator thread");
+        return -1;
+    }
+    pthread_mutex_unlock(&validatorThreadMutex);
     return 0;
 }
+int heap_validator_stop(void)
+{
+    pthread_mutex_lock(&validatorThreadMutex);
+    if(!validatorRunning)
+    {
+        pthread_mutex_unlock(&validatorThreadMutex);
+        ConsoleLog(__f, "Validator isn't running");
+        return -1;
+    }
+    validatorRunning = false;
+    pthread_cond_signal(&validatorWake);
+    pthread_mutex_unlock(&validatorThreadMutex);
+    pthread_join(validatorThread, NULL);
+    return atomic_load(&validatorFailed) ? -1 : 0;
+}
 
 void heap_dump_debug_information(void)
 {
 
-    if(heap.isInitialized == false){
+    if(defaultArena.heap.isInitialized == false){
         ConsoleLog(__f, "Heap doesn't exist");
         return;
     }
-    printf("\n\n\t\t\t\t\t\tHEAP INFORMATIONS\n");
-    printf("INDEX\t\tADDRESS\t\t\t\tSIZE\tFREE\tFILENAME\tFILELINE\n");
-    Chunk* current = heap.head;
-    for(int i=0; current; ++i)
-    {
-        printf("%5i", i);
-        printf("\t\t%p", current);
-        printf("\t\t%4li", current->size);
-        printf("\t%4s", current->isFree ? "YES" : "NO");
-        if(current->debugParams.fileName && current != heap.head && current != heap.tail)
-            printf("\t%8s\t%8i\n", current->debugParams.fileName, current->debugParams.lineNumber);
-        else
-            printf("\t--------\t--------\n");
-        current = current->next;
+    Arena* arenas[ARENAS_MAX];
+    unsigned int count = sharedArenas(arenas);
+    for(unsigned int arena = 0; arena < count; ++arena)
+    {
+        Heap* heap = &arenas[arena]->heap;
+        printf("\n\n\t\t\t\t\t\tHEAP INFORMATIONS\n");
+        if(count > 1)
+            printf("ARENA %u\n", arena);
+        printf("INDEX\t\tADDRESS\t\t\t\tSIZE\tFREE\tFILENAME\tFILELINE\n");
+        Chunk* current = heap->head;
+        for(int i=0; current; ++i)
+        {
+            printf("%5i", i);
+            printf("\t\t%p", current);
+            printf("\t\t%4li", current->size);
+            printf("\t%4s", current->isFree ? "YES" : "NO");
+#ifdef HEAP_CHUNK_DEBUG
+            if(chunkDebug(current)->debugParams.fileName && current != heap->head && current != heap->tail)
+                printf("\t%8s\t%8i\n", chunkDebug(current)->debugParams.fileName, chunkDebug(current)->debugParams.lineNumber);
+            else
+#endif
+                printf("\t--------\t--------\n");
+            current = current->next;
+        }
     }
     printf("\n\t\t\t\t\tHEAP INFORMATIONS\n");
-    printf("Used chunks: %i\n", heap.chunksCount.used);
-    printf("Free chunks: %i\n", heap.chunksCount.free);
-    printf("Fences value: %i\n", heap.secondFence);
+    printf("Used chunks: %llu\n", (unsigned long long)heap_get_used_blocks_count());
+    printf("Free chunks: %llu\n", (unsigned long long)heap_get_free_gaps_count());
+    printf("Fences value: %i\n", defaultArena.heap.secondFence);
     printf("Biggest free chunk size: %i\n", heap_get_largest_free_area());
     printf("Used space size: %li\n", heap_get_used_space());
     printf("Free space size: %li\n", heap_get_free_space());
@@ -956,98 +4055,291 @@ void heap_dump_debug_information(void)
 }
 
 
+void* heap_malloc_nts_debug(size_t count, int fileline, const char* filename)
+{
+    void* memory = heapMalloc(&defaultArena.heap, count, fileline, filename);
+    statsPublish(&defaultArena);
+    profileMalloc(memory, count, fileline, filename);
+    traceRecord(trace_malloc, memory, NULL, count, 0);
+    return memory;
+}
+void* heap_calloc_nts_debug(size_t number, size_t size, int fileline, const char* filename)
+{
+    void* memory = heapCalloc(&defaultArena.heap, number, size, fileline, filename);
+    statsPublish(&defaultArena);
+    profileMalloc(memory, number * size, fileline, filename);
+    traceRecord(trace_calloc, memory, NULL, number * size, 0);
+    return memory;
+}
+void* heap_realloc_nts_debug(void* memblock, size_t size, int fileline, const char* filename)
+{
+    profileFree(memblock);
+    void* memory = heapRealloc(&defaultArena.heap, memblock, size, fileline, filename);
+    statsPublish(&defaultArena);
+    profileMalloc(memory, size, fileline, filename);
+    traceRecord(trace_realloc, memory, memblock, size, 0);
+    return memory;
+}
+void heap_free_nts(void* memblock)
+{
+    profileFree(memblock);
+    traceRecord(trace_free, memblock, NULL, 0, 0);
+    heapFree(&defaultArena.heap, memblock);
+    statsPublish(&defaultArena);
+}
+void* heap_memalign_nts_debug(size_t alignment, size_t count, int fileline, const char* filename)
+{
+    void* memory = heapMallocAligned(&defaultArena.heap, count, alignment, fileline, filename);
+    statsPublish(&defaultArena);
+    profileMalloc(memory, count, fileline, filename);
+    traceRecord(trace_memalign, memory, NULL, count, alignment);
+    return memory;
+}
+void* heap_calloc_aligned_nts_debug(size_t number, size_t size, int fileline, const char* filename)
+{
+    void* memory = heapCallocAligned(&defaultArena.heap, number, size, PAGE_SIZE, fileline, filename);
+    statsPublish(&defaultArena);
+    profileMalloc(memory, number * size, fileline, filename);
+    traceRecord(trace_calloc, memory, NULL, number * size, PAGE_SIZE);
+    return memory;
+}
+void* heap_malloc_aligned_nts_debug(size_t count, int fileline, const char* filename)
+{
+    return heap_memalign_nts_debug(PAGE_SIZE, count, fileline, filename);
+}
+void* heap_realloc_aligned_nts_debug(void* memblock, size_t size, int fileline, const char* filename)
+{
+    profileFree(memblock);
+    void* memory = heapReallocAligned(&defaultArena.heap, memblock, size, PAGE_SIZE, fileline, filename);
+    statsPublish(&defaultArena);
+    profileMalloc(memory, size, fileline, filename);
+    traceRecord(trace_realloc, memory, memblock, size, PAGE_SIZE);
+    return memory;
+}
+
 void* heap_malloc_ts_debug(size_t count, int fileline, const char* filename)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_malloc_nts_debug(count, fileline, filename);
-    pthread_mutex_unlock(&mutex);
+    Arena* arena = threadArena();
+    pthread_mutex_lock(&arena->mutex);
+    void* memory = heapMalloc(&arena->heap, count, fileline, filename);
+    arenaUnlock(arena);
+    profileMalloc(memory, count, fileline, filename);
+    traceRecord(trace_malloc, memory, NULL, count, 0);
     return memory;
 }
 void* heap_calloc_ts_debug(size_t number, size_t size, int fileline, const char* filename)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_calloc_nts_debug(number, size, fileline, filename);
-    pthread_mutex_unlock(&mutex);
+    Arena* arena = threadArena();
+    pthread_mutex_lock(&arena->mutex);
+    void* memory = heapCalloc(&arena->heap, number, size, fileline, filename);
+    arenaUnlock(arena);
+    profileMalloc(memory, number * size, fileline, filename);
+    traceRecord(trace_calloc, memory, NULL, number * size, 0);
     return memory;
 }
 void* heap_realloc_ts_debug(void* memblock, size_t size, int fileline, const char* filename)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_realloc_nts_debug(memblock, size, fileline, filename);
-    pthread_mutex_unlock(&mutex);
+    Arena* arena = memblock ? arenaOf(memblock) : threadArena();
+    pthread_mutex_lock(&arena->mutex);
+    void* memory = heapRealloc(&arena->heap, memblock, size, fileline, filename);
+    // A failed realloc keeps the block and its sample. Under the lock, the address a move gave
+    // back can't be handed out and sampled by another thread first
+    if(memory != NULL || size == 0)
+        profileFree(memblock);
+    arenaUnlock(arena);
+    profileMalloc(memory, size, fileline, filename);
+    traceRecord(trace_realloc, memory, memblock, size, 0);
+    return memory;
+}
+void* heap_memalign_ts_debug(size_t alignment, size_t count, int fileline, const char* filename)
+{
+    Arena* arena = threadArena();
+    pthread_mutex_lock(&arena->mutex);
+    void* memory = heapMallocAligned(&arena->heap, count, alignment, fileline, filename);
+    arenaUnlock(arena);
+    profileMalloc(memory, count, fileline, filename);
+    traceRecord(trace_memalign, memory, NULL, count, alignment);
     return memory;
 }
 void* heap_calloc_aligned_ts_debug(size_t number, size_t size, int fileline, const char* filename)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_calloc_aligned_nts_debug(number, size, fileline, filename);
-    pthread_mutex_unlock(&mutex);
+    Arena* arena = threadArena();
+    pthread_mutex_lock(&arena->mutex);
+    void* memory = heapCallocAligned(&arena->heap, number, size, PAGE_SIZE, fileline, filename);
+    arenaUnlock(arena);
+    profileMalloc(memory, number * size, fileline, filename);
+    traceRecord(trace_calloc, memory, NULL, number * size, PAGE_SIZE);
     return memory;
 }
 void* heap_malloc_aligned_ts_debug(size_t count, int fileline, const char* filename)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_malloc_aligned_nts_debug(count, fileline, filename);
-    pthread_mutex_unlock(&mutex);
-    return memory;
+    return heap_memalign_ts_debug(PAGE_SIZE, count, fileline, filename);
 }
 void* heap_realloc_aligned_ts_debug(void* memblock, size_t size, int fileline, const char* filename)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_realloc_aligned_nts_debug(memblock, size, fileline, filename);
-    pthread_mutex_unlock(&mutex);
+    Arena* arena = memblock ? arenaOf(memblock) : threadArena();
+    pthread_mutex_lock(&arena->mutex);
+    void* memory = heapReallocAligned(&arena->heap, memblock, size, PAGE_SIZE, fileline, filename);
+    // Same as heap_realloc_ts_debug, only a realloc that went through drops the sample
+    if(memory != NULL || size == 0)
+        profileFree(memblock);
+    arenaUnlock(arena);
+    profileMalloc(memory, size, fileline, filename);
+    traceRecord(trace_realloc, memory, memblock, size, PAGE_SIZE);
     return memory;
 }
 
 void *heap_malloc(size_t count)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_malloc_ts_debug(count, 0, NULL);
-    pthread_mutex_unlock(&mutex);
-    return memory;
+    void* memory = threadCacheMalloc(count);
+    if(memory != NULL)
+    {
+        profileMalloc(memory, count, 0, NULL);
+        traceRecord(trace_malloc, memory, NULL, count, 0);
+        return memory;
+    }
+    return heap_malloc_ts_debug(count, 0, NULL);
 }
 void *heap_calloc(size_t number, size_t size)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_calloc_ts_debug(number, size, 0, NULL);
-    pthread_mutex_unlock(&mutex);
-    return memory;
+    void* memory = NULL;
+    if(size != 0 && SIZE_MAX / size >= number)
+        memory = threadCacheMalloc(number * size);
+    if(memory != NULL)
+    {
+        profileMalloc(memory, number * size, 0, NULL);
+        traceRecord(trace_calloc, memory, NULL, number * size, 0);
+        return memset(memory, 0, number * size);
+    }
+    return heap_calloc_ts_debug(number, size, 0, NULL);
 }
 void *heap_realloc(void* memblock, size_t size)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_realloc_ts_debug(memblock, size, 0, NULL);
-    pthread_mutex_unlock(&mutex);
-    return memory;
+    return heap_realloc_ts_debug(memblock, size, 0, NULL);
 }
 
+void arenaFree(void* memblock, size_t size)
+{
+     // A hint past the mmap threshold tries the mappings before the arenas
+     size_t threshold = atomic_load_explicit(&mmapThreshold, memory_order_relaxed);
+     bool mapped = size != 0 && threshold != 0 && ceilWord(size) >= threshold;
+     Arena* arena = mapped ? NULL : sharedArenaOf(memblock);
+     // Mappings aren't part of any arena, they go back to the OS without an arena lock
+     if(arena == NULL && largeFree(memblock, size))
+         return;
+     if(arena == NULL && mapped)
+         arena = sharedArenaOf(memblock);
+     if(arena == NULL)
+         arena = privateArenaOf(memblock);
+     if(arena == NULL)
+         arena = &defaultArena;
+     // Blocks of another thread's arena, or of a busy one, are left for its next allocation
+     if(arena != threadArena() || pthread_mutex_trylock(&arena->mutex) != 0)
+     {
+         if(remoteFree(memblock))
+             return;
+         pthread_mutex_lock(&arena->mutex);
+     }
+     // A queued block is free after the drain, so freeing it again is reported as a double free
+     heapDrainRemote(&arena->heap);
+     heapFreeSized(&arena->heap, memblock, size);
+     arenaUnlock(arena);
+}
 void heap_free(void* memblock)
 {
-     pthread_mutex_lock(&mutex);
-     heap_free_nts(memblock);
-     pthread_mutex_unlock(&mutex);
+     profileFree(memblock);
+     traceRecord(trace_free, memblock, NULL, 0, 0);
+     if(threadCacheFree(memblock, 0))
+         return;
+     arenaFree(memblock, 0);
+}
+void heap_free_sized(void* memblock, size_t size)
+{
+    if(memblock == NULL)
+        return;
+    profileFree(memblock);
+    traceRecord(trace_free, memblock, NULL, 0, 0);
+    // Hints are checked where the block is found, under whatever lock that path takes anyway
+    if(ceilWord(size) <= THREAD_CACHE_MAX_SIZE && threadCacheFree(memblock, size))
+        return;
+    arenaFree(memblock, size);
+}
+void* heap_realloc_sized(void* memblock, size_t oldSize, size_t size)
+{
+    if(memblock == NULL || size == 0 || oldSize == 0)
+        return heap_realloc(memblock, size);
+    Arena* arena = arenaOf(memblock);
+    pthread_mutex_lock(&arena->mutex);
+    void* memory = heapReallocSized(&arena->heap, memblock, oldSize, size, 0, NULL);
+    if(memory != NULL)
+        profileFree(memblock);
+    arenaUnlock(arena);
+    profileMalloc(memory, size, 0, NULL);
+    traceRecord(trace_realloc, memory, memblock, size, 0);
+    return memory;
 }
 
 
+void* heap_memalign(size_t alignment, size_t size)
+{
+    return heap_memalign_ts_debug(alignment, size, 0, NULL);
+}
+void* heap_aligned_alloc(size_t alignment, size_t size)
+{
+    return heap_memalign(alignment, size);
+}
+size_t heap_malloc_batch(size_t size, size_t count, void** out)
+{
+    Arena* arena = threadArena();
+    pthread_mutex_lock(&arena->mutex);
+    size_t taken = heapMallocBatch(&arena->heap, size, count, out, 0, NULL);
+    arenaUnlock(arena);
+    for(size_t i = 0; i < taken; ++i)
+    {
+        profileMalloc(out[i], size, 0, NULL);
+        traceRecord(trace_malloc, out[i], NULL, size, 0);
+    }
+    return taken;
+}
+int comparePointers(const void* first, const void* second)
+{
+    uintptr_t a = (uintptr_t)*(void* const*)first, b = (uintptr_t)*(void* const*)second;
+    return (a > b) - (a < b);
+}
+void heap_free_batch(void** memblocks, size_t count)
+{
+    if(memblocks == NULL)
+        return;
+    for(size_t i = 0; i < count; ++i)
+    {
+        profileFree(memblocks[i]);
+        traceRecord(trace_free, memblocks[i], NULL, 0, 0);
+    }
+    qsort(memblocks, count, sizeof(void*), comparePointers);
+    for(size_t i = 0; i < count;)
+    {
+        // After sorting the blocks of one arena sit next to each other
+        Arena* arena = arenaOf(memblocks[i]);
+        size_t end = i + 1;
+        while(end < count && arenaOf(memblocks[end]) == arena)
+            end++;
+        pthread_mutex_lock(&arena->mutex);
+        heapFreeBatch(&arena->heap, memblocks + i, end - i);
+        arenaUnlock(arena);
+        i = end;
+    }
+}
+
 void* heap_malloc_aligned(size_t count)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_malloc_aligned_ts_debug(count, 0, NULL);
-    pthread_mutex_unlock(&mutex);
-    return memory;
+    return heap_memalign(PAGE_SIZE, count);
 }
 void* heap_realloc_aligned(void* memblock, size_t size)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_realloc_aligned_ts_debug(memblock, size, 0, NULL);
-    pthread_mutex_unlock(&mutex);
-    return memory;
+    return heap_realloc_aligned_ts_debug(memblock, size, 0, NULL);
 }
 
 void* heap_calloc_aligned(size_t number, size_t size)
 {
-    pthread_mutex_lock(&mutex);
-    void* memory = heap_calloc_aligned_ts_debug(number, size, 0, NULL);
-    pthread_mutex_unlock(&mutex);
-    return memory;
+    return heap_calloc_aligned_ts_debug(number, size, 0, NULL);
 }
@@ -7,25 +7,200 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define __f __FUNCTION__
 
+// Free chunks are kept in segregated bins: exact bins for every word-multiple up to
+// SMALL_BIN_LIMIT and one bin per power of two above it
+#define SMALL_BINS_COUNT 64
+#define LARGE_BINS_COUNT 22
+#define BINS_COUNT (SMALL_BINS_COUNT + LARGE_BINS_COUNT)
+#define SMALL_BIN_LIMIT (SMALL_BINS_COUNT * sizeof(void*))
+#define BINS_MAP_WORDS 2
+// Free chunks are also counted by size, bucket i holds sizes in [2^i, 2^(i+1))
+#define FREE_HISTOGRAM_BUCKETS 32
+// Placement policies other than placement_segregated also index free chunks of the large bins
+// in two treaps, kept in the chunks' data
+#define TREE_BY_SIZE 0
+#define TREE_BY_ADDRESS 1
+// Deferred coalescing parks small freed chunks on exact-size quick lists without merging them
+#define QUICK_LIST_MAX_SIZE 256
+#define QUICK_LISTS_COUNT (QUICK_LIST_MAX_SIZE / sizeof(void*))
+
+// Small heap_malloc/heap_free requests are served from per-thread caches
+#define THREAD_CACHE_MAX_SIZE 256
+#define THREAD_CACHE_CLASSES (THREAD_CACHE_MAX_SIZE / sizeof(void*))
+#define THREAD_CACHE_BATCH 16
+
+// Arenas other than the default one live in reserved mappings
+#define ARENAS_MAX 64
+#define PRIVATE_ARENA_SLOTS 64
+#define ARENA_RESERVE ((size_t)1 << 30)
+#define REMOTE_DRAIN_BATCH 64
+
+// Sampling profiler tables, both sizes are powers of two
+#define PROFILE_SITES 1024
+#define PROFILE_SAMPLES 16384
+#define PROFILE_FILTER_SIZE 65536
+
+// Snapshots copy this many chunks per arena lock, lines are written out through a buffer
+#define SNAPSHOT_BATCH 256
+#define SNAPSHOT_BUFFER 8192
+#define SNAPSHOT_LINE 512
+
+// Trace records are buffered per thread and written out this many at a time
+#define TRACE_BUFFER 128
+#define HEAP_TRACE_MAGIC "HEAPTRC1"
+
+// Small blocks can be packed into slabs, page-sized chunks split into equal slots without headers
+#define SLAB_SIZE 4096
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE / sizeof(void*))
+#define SLAB_MAP_WORDS (SLAB_SIZE / sizeof(void*) / 64)
+
+// HEAP_COMPACT_HEADER leaves only sizes, flags and links in chunk headers. Fences, control sums
+// and debug params then move to a sidecar table, which is only kept in debug builds (no NDEBUG)
+#if !defined(HEAP_COMPACT_HEADER) || !defined(NDEBUG)
+#define HEAP_CHUNK_DEBUG
+#endif
+// Headers carry word-wise control sums unless HEAP_NO_CHECKSUM is defined (e.g. for release builds)
+#if defined(HEAP_CHUNK_DEBUG) && !defined(HEAP_NO_CHECKSUM)
+#define HEAP_CHECKSUM
+#endif
+#define SIDECAR_REGION_SHIFT 26
+#define SIDECAR_REGIONS ((size_t)1 << ((sizeof(void*) == 8 ? 47 : 32) - SIDECAR_REGION_SHIFT))
+#define SIDECAR_GRANULE_SHIFT (sizeof(void*) == 8 ? 5 : 4) // no two chunks start within a granule
+
 typedef struct DebugParams{
     const char* fileName;
-    uint8_t lineNumber;
+    int32_t lineNumber;
 }DebugParams;
 
 typedef struct Chunk{
+#ifndef HEAP_COMPACT_HEADER
     int32_t firstFence;
+#endif
     int32_t size;
     bool isFree;
+    bool isSlab;
+    bool isQuick; // parked on a quick list, used to its neighbours and free to everyone else
     struct Chunk* next;
     struct Chunk* prev;
+    struct Chunk* nextFree;
+    struct Chunk* prevFree;
+#ifndef HEAP_COMPACT_HEADER
     int32_t sumOfBytes;
     DebugParams debugParams;
     int32_t secondFence;
+#endif
 }Chunk;
 
+// Sidecar entry of a compact chunk, named like the Chunk fields it replaces
+typedef struct ChunkDebug{
+    int32_t firstFence;
+    int32_t sumOfBytes;
+    DebugParams debugParams;
+    int32_t secondFence;
+}ChunkDebug;
+
+// Lives in the data of a slab chunk, slots follow it
+typedef struct Slab{
+    int32_t firstFence;
+    uint32_t slotSize;
+    uint32_t slotsCount;
+    uint32_t usedCount;
+    struct Slab* next;
+    struct Slab* prev;
+    uint64_t usedMap[SLAB_MAP_WORDS];
+    int32_t secondFence;
+}Slab;
+
+// Allocation above the mmap threshold, it owns the whole mapping and has no chunk header
+typedef struct LargeBlock{
+    uint8_t* memory;
+    size_t mapped;
+    size_t size;
+}LargeBlock;
+
+// Aggregates of one (fileName, lineNumber) call site, estimated from samples
+typedef struct ProfileSite{
+    const char* fileName;
+    int32_t lineNumber;
+    bool isUsed;
+    size_t liveBytes;
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+    uint64_t freedSamples;
+    uint64_t lifetimeNs; // summed over freed samples
+}ProfileSite;
+
+// Sampled live block, stands for weight bytes and count allocations of its site
+typedef struct ProfileSample{
+    const void* memblock;
+    ProfileSite* site;
+    size_t weight;
+    uint64_t count;
+    uint64_t start;
+    struct ProfileSample* next;
+}ProfileSample;
+
+// Chunk copied by a snapshot, address points at the data
+typedef struct SnapshotRecord{
+    const void* address;
+    size_t size;
+    const char* fileName;
+    int32_t lineNumber;
+    const char* state;
+    uint32_t slotsUsed;
+}SnapshotRecord;
+
+typedef struct SnapshotWriter{
+    int fd;
+    size_t used;
+    bool failed;
+    char buffer[SNAPSHOT_BUFFER];
+}SnapshotWriter;
+
+// Data of a free chunk in the trees, by (size, address) for best fit and by address for first and next fit
+typedef struct FreeNode{
+    struct Chunk* children[2][2]; // [tree][left, right]
+    size_t maxSize; // largest chunk in the address subtree
+}FreeNode;
+
+typedef struct FreeTrees{
+    struct Chunk* bySize;
+    struct Chunk* byAddress;
+    uintptr_t rover; // next fit goes on from here
+}FreeTrees;
+
+// Largest chunk of the highest non-empty large bin and how many chunks have that size, kept by
+// bin inserts and removes. Once the last of them goes the size is stale, and the bin's upper bound
+// stands in for it until a larger chunk comes in
+typedef struct LargestSize{
+    size_t size;
+    uint32_t count;
+    bool isStale;
+}LargestSize;
+
+// Used chunks counted by the bin they would take, so the largest one is known without a walk.
+// Bytes of a large bin narrow its bound down, a chunk alone in it is known exactly
+typedef struct UsedSizes{
+    uint32_t small[SMALL_BINS_COUNT];
+    uint64_t smallMap;
+    uint32_t large[LARGE_BINS_COUNT];
+    size_t largeBytes[LARGE_BINS_COUNT];
+    uint64_t largeMap;
+    LargestSize largest;
+}UsedSizes;
+
+// Parked chunks are linked through nextFree and counted as free chunks
+typedef struct QuickLists{
+    struct Chunk* lists[QUICK_LISTS_COUNT];
+    size_t bytes;
+}QuickLists;
+
 typedef struct Boundaries{
     Chunk* leftBound;
     Chunk* rightBound;
@@ -34,6 +209,8 @@ typedef struct Boundaries{
 typedef struct ChunkCount{
     uint32_t free;
     uint32_t used;
+    size_t freeBytes;
+    size_t usedBytes; // headers and data of used chunks
 }ChunkCount;
 
 
@@ -45,9 +222,182 @@ typedef struct Heap{
     Chunk* head;
     Chunk* tail;
     Boundaries boundaries;
+    Chunk* bins[BINS_COUNT];
+    uint64_t binsMap[BINS_MAP_WORDS];
+    uint32_t freeHistogram[FREE_HISTOGRAM_BUCKETS];
+    FreeTrees trees;
+    LargestSize largestFree; // segregated placement only, the size tree has it otherwise
+    UsedSizes usedSizes;
+    QuickLists quick;
+    Slab* slabs[SLAB_CLASSES]; // slabs with free slots
+    uint64_t* chunkMap; // bit per word of the arena, set where a chunk starts
+    uint64_t* pageMap; // bit per page, set when the page holds a chunk start
+    size_t mapSpan;
     int32_t secondFence;
 }Heap;
 
+// Lives in the data of a block freed while its arena was busy or owned by another thread
+typedef struct RemoteBlock{
+    struct RemoteBlock* next;
+    uintptr_t key;
+}RemoteBlock;
+
+// Counters published for readers that don't take the lock guarding them, an arena's lock or
+// largeBlocksMutex for the large block table. Writers hold it, sequence is odd while they copy in
+typedef struct StatsSeqlock{
+    atomic_uint sequence;
+    atomic_uint_fast64_t usedChunks;
+    atomic_uint_fast64_t freeChunks;
+    atomic_size_t usedBytes;
+    atomic_size_t freeBytes;
+    atomic_size_t largestFree;
+    atomic_size_t largestUsed;
+}StatsSeqlock;
+
+typedef struct ArenaStats{
+    uint64_t usedChunks;
+    uint64_t freeChunks;
+    size_t usedBytes;
+    size_t freeBytes;
+    size_t largestFree;
+    size_t largestUsed;
+}ArenaStats;
+
+typedef struct Arena{
+    Heap heap;
+    pthread_mutex_t mutex;
+    StatsSeqlock stats;
+    uint8_t* base;
+    size_t reserved; // 0 when the arena grows through custom_sbrk
+    atomic_uintptr_t end;
+    bool isPrivate;
+    _Atomic(RemoteBlock*) remoteFrees; // pushed without the lock, drained by the next allocation
+    unsigned int pins; // private arenas only, guarded by arenasMutex
+    struct Arena* next;
+    struct Arena* prev;
+}Arena;
+
+// Where a private arena's mapping lies, for frees that don't take arenasMutex. Written under
+// arenasMutex, sequence is odd while a slot changes
+typedef struct ArenaRange{
+    atomic_uint sequence;
+    atomic_uintptr_t begin;
+    atomic_uintptr_t limit;
+    _Atomic(Arena*) arena;
+}ArenaRange;
+
+// Lives in the data of a cached block
+typedef struct CachedBlock{
+    struct CachedBlock* next;
+    uintptr_t key;
+}CachedBlock;
+
+typedef struct ThreadCache{
+    pthread_mutex_t lock;
+    CachedBlock* bins[THREAD_CACHE_CLASSES];
+    size_t cachedBytes;
+    uint64_t cachedBlocks;
+    bool isRegistered;
+    struct ThreadCache* next;
+    struct ThreadCache* prev;
+}ThreadCache;
+
+enum heap_option_t
+{
+    option_thread_cache_limit,
+    option_arena_count,
+    option_arena_assignment,
+    option_slab_allocator,
+    option_trim_threshold,
+    option_mmap_threshold,
+    option_profile_sample_rate,
+    option_placement_policy,
+    option_deferred_coalescing, // parked bytes that trigger a consolidation, 0 merges on every free
+    option_adaptive_locks // arena mutexes spin before they sleep, only set before heap_setup
+};
+
+// Picks the free chunk a block is carved from. Small requests keep their exact-size bins under
+// every policy, the others choose among chunks of the large bins. Only set before heap_setup
+enum placement_policy_t
+{
+    placement_segregated, // first chunk of the first bin that fits
+    placement_first_fit, // lowest address
+    placement_next_fit, // lowest address past the previous pick, then from the start
+    placement_best_fit // smallest chunk, lowest address among equal ones
+};
+
+// One call site as reported by the profiler; byte and allocation counts are estimates
+struct heap_profile_site_t
+{
+    const char* fileName;
+    int lineNumber;
+    size_t liveBytes;
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+    double bytesPerSecond;
+    double averageLifetime; // seconds, over sampled blocks that were freed
+};
+
+// Filled by heap_get_stats while every shared arena is locked, so the numbers agree with each other.
+// Blocks in thread caches count as used until a flush gives them back, here and in heap_get_* alike
+struct heap_stats_t
+{
+    size_t usedSpace; // headers and data of used blocks, large blocks by their mappings
+    size_t freeSpace;
+    size_t largestFreeArea;
+    uint64_t freeBlocks;
+    uint64_t freeHistogram[FREE_HISTOGRAM_BUCKETS]; // free blocks of [2^i, 2^(i+1)) bytes
+    double fragmentation; // 1 - largestFreeArea / freeSpace
+    size_t headerBytes;
+    size_t osBytes; // taken from the OS by every arena and large block
+    size_t peakOsBytes;
+};
+
+enum arena_assignment_t
+{
+    assign_round_robin,
+    assign_by_cpu
+};
+
+enum heap_trace_op_t
+{
+    trace_malloc,
+    trace_calloc,
+    trace_realloc,
+    trace_free,
+    trace_memalign
+};
+
+// Trace files start with the 8 bytes of HEAP_TRACE_MAGIC, records follow in per-thread runs, so they
+// have to be sorted by time before a replay. Ids are block addresses, unique among live blocks
+struct heap_trace_record_t
+{
+    uint64_t time; // nanoseconds since heap_trace_start
+    uint64_t id; // 0 when realloc freed the block
+    uint64_t oldId; // realloc only
+    uint64_t size; // calloc records number * size
+    uint32_t thread;
+    uint16_t op;
+    uint16_t alignmentShift; // log2 of the requested alignment, 0 without one
+};
+
+// Where the incremental validator stopped, guarded by validatorMutex
+typedef struct ValidatorCursor{
+    unsigned int arena; // index into sharedArenas
+    uintptr_t resume; // first address not checked yet, 0 starts from the head
+    int blockID;
+}ValidatorCursor;
+
+typedef struct TraceBuffer{
+    pthread_mutex_t lock;
+    struct heap_trace_record_t records[TRACE_BUFFER];
+    size_t count;
+    uint32_t thread;
+    bool isRegistered;
+    struct TraceBuffer* next;
+    struct TraceBuffer* prev;
+}TraceBuffer;
+
 enum pointer_type_t
 {
     pointer_null,
@@ -59,22 +409,180 @@ enum pointer_type_t
 };
 
 void ConsoleLog(char*, char*);
-void setBoundaries(void*);
+void setBoundaries(Heap*, void*);
 void setFences(int, ...);
 void setSum(int, ...);
-void heapSetSum();
+void setDebugParams(Chunk*, int, const char*);
+bool sidecarReserve(const void*, size_t);
+#ifdef HEAP_COMPACT_HEADER
+ChunkDebug* chunkDebug(const Chunk*);
+#else
+#define chunkDebug(chunk) (chunk)
+#endif
+void heapSetSum(Heap*);
+int32_t wordsSum(const void*, size_t);
+void sumField(int32_t*, const void*, size_t, int);
+void setChunkLink(Chunk*, Chunk**, Chunk*);
 size_t ceilWord(size_t);
-int getSpace(intptr_t);
-void splitChunk(Chunk* firstChunk, size_t count);
-void mergeChunks(Chunk* firstChunk, Chunk* secondChunk);
-bool chunkExists(Chunk*);
-Chunk* findAligned(size_t);
-intptr_t alignedMemory(intptr_t, intptr_t);
-void updateChunksCount();
+int getSpace(Heap*, intptr_t);
+void shrinkTail(Heap*, intptr_t);
+size_t heapTrim(Heap*, size_t);
+void splitChunk(Heap*, Chunk* firstChunk, size_t count);
+void mergeChunks(Heap*, Chunk* firstChunk, Chunk* secondChunk);
+bool chunkExists(Heap*, Chunk*);
+Chunk* findAligned(Heap*, size_t, size_t);
+Chunk* carveAligned(Heap*, Chunk*, size_t, size_t);
+intptr_t alignedMemory(intptr_t, size_t);
+void updateChunksCount(Heap*, int32_t, int32_t, intptr_t, intptr_t);
+unsigned int binIndex(size_t);
+unsigned int histogramBucket(size_t);
+void histogramUpdate(Heap*, size_t, int);
+void binInsert(Heap*, Chunk*);
+void binRemove(Heap*, Chunk*);
+Chunk* findFreeChunk(Heap*, size_t);
+FreeNode* freeNode(const Chunk*);
+uint32_t treePriority(const Chunk*);
+bool treeLess(const Chunk*, const Chunk*, int);
+void treeUpdate(Chunk*);
+void treeSplit(Chunk*, const Chunk*, int, Chunk**, Chunk**);
+Chunk* treeMerge(Chunk*, Chunk*, int);
+Chunk* treeInsert(Chunk*, Chunk*, int);
+Chunk* treeRemove(Chunk*, Chunk*, int);
+Chunk* treeBestFit(Chunk*, size_t);
+Chunk* treeFirstFit(Chunk*, size_t, uintptr_t);
+Chunk* treeFind(Heap*, size_t);
+Chunk* treeLast(Chunk*, int);
+void treesUpdate(Heap*, Chunk*, bool);
+int64_t treeValidate(Heap*, Chunk*, int, const Chunk*, const Chunk*);
+int highestBin(uint64_t);
+void largestInsert(Heap*, LargestSize*, int, int, size_t);
+void largestRemove(Heap*, LargestSize*, int, int, size_t);
+size_t largestOf(const LargestSize*, int, size_t);
+void usedInsert(Heap*, Chunk*);
+void usedRemove(Heap*, Chunk*);
+int usedSizesValidate(Heap*, const uint32_t*, const uint32_t*, const size_t*);
+int largestValidate(const LargestSize*, size_t, uint32_t);
+void quickPush(Heap*, Chunk*);
+Chunk* quickPop(Heap*, size_t);
+void heapConsolidate(Heap*);
+void setChunkUsed(Heap*, Chunk*);
+void setChunkFree(Heap*, Chunk*);
+int chunkMapSetup(Heap*, size_t);
+void chunkMapSet(Heap*, Chunk*, bool);
+bool chunkMapTest(Heap*, const void*);
+Chunk* chunkMapFind(Heap*, const void*);
+void slabLink(Heap*, Slab*);
+void slabUnlink(Heap*, Slab*);
+Slab* slabOf(Heap*, const void*);
+void* slabMalloc(Heap*, size_t);
+void slabFree(Heap*, Slab*, void*);
+void* slabRealloc(Heap*, Slab*, void*, size_t, size_t, int, const char*);
+int slabValidate(Heap*, Chunk*);
+
+LargeBlock* largeBlockFind(const void*);
+bool largeBlockInsert(uint8_t*, size_t, size_t);
+void largeBlockRemove(LargeBlock*);
+void largeBlocksUpdate(intptr_t, int64_t, size_t, size_t);
+void* largeMalloc(size_t, size_t);
+bool largeFree(void*, size_t);
+void* largeRealloc(Heap*, void*, size_t, size_t, int, const char*);
+size_t largeBlockSize(const void*);
+void* largeBlockStart(const void*);
+enum pointer_type_t largePointerType(const void*);
+void largeBlocksUsage(size_t*, uint64_t*, size_t*);
+int largeBlocksValidate(void);
+
+uint64_t profileNow(void);
+size_t profileHash(const void*, size_t);
+ProfileSite* profileSiteOf(const char*, int32_t);
+void profileMalloc(const void*, size_t, int, const char*);
+void profileFree(const void*);
+void profileForget(const void*, const void*);
+int compareProfileSites(const void*, const void*);
+
+void statsOsBytes(intptr_t);
+
+bool writeAll(int, const void*, size_t);
+void snapshotFlush(SnapshotWriter*);
+void snapshotWrite(SnapshotWriter*, const char*, ...);
+void snapshotQuote(char*, size_t, const char*);
+void snapshotArena(SnapshotWriter*, Arena*, unsigned int);
+void snapshotLargeBlocks(SnapshotWriter*);
+
+void traceKeyCreate(void);
+void traceRegister(TraceBuffer*);
+void traceFlush(TraceBuffer*);
+void traceDestroy(void*);
+void traceRecord(enum heap_trace_op_t, const void*, const void*, size_t, size_t);
+
+int arenaSetup(Arena*);
+void* arenaSbrk(Arena*, intptr_t);
+void arenaUnlock(Arena*);
+void statsPublish(Arena*);
+void statsStore(StatsSeqlock*, const ArenaStats*);
+void statsRead(StatsSeqlock*, ArenaStats*);
+void arenaMutexInit(pthread_mutex_t*);
+Arena* arenaMap(size_t, bool);
+Arena* poolArena(unsigned int);
+Arena* threadArena(void);
+Arena* sharedArenaOf(const void*);
+void privateRangeSet(ArenaRange*, Arena*);
+Arena* privateArenaOf(const void*);
+Arena* arenaOf(const void*);
+unsigned int sharedArenas(Arena**);
+bool remoteFree(void*);
+void arenaFree(void*, size_t);
+void heapDrainRemote(Heap*);
+
+void* heapMalloc(Heap*, size_t count, int fileline, const char* filename);
+void* heapMallocChunk(Heap*, size_t count, int fileline, const char* filename);
+size_t carveRun(Heap*, Chunk*, size_t size, size_t count, void** out, int fileline, const char* filename);
+size_t heapMallocChunks(Heap*, size_t size, size_t count, void** out, int fileline, const char* filename);
+size_t heapMallocBatch(Heap*, size_t size, size_t count, void** out, int fileline, const char* filename);
+void* heapCalloc(Heap*, size_t number, size_t size, int fileline, const char* filename);
+Chunk* heapReallocInPlace(Heap*, Chunk*, size_t);
+void* heapRealloc(Heap*, void* memblock, size_t size, int fileline, const char* filename);
+void heapFree(Heap*, void* memblock);
+void heapFreeBatch(Heap*, void** memblocks, size_t count);
+void heapFreeSized(Heap*, void* memblock, size_t size);
+void* heapReallocSized(Heap*, void* memblock, size_t oldSize, size_t size, int fileline, const char* filename);
+bool chunkFitsHint(const Chunk*, size_t);
+int heapCheckSizeHint(Heap*, const void* memblock, size_t size);
+int comparePointers(const void*, const void*);
+void* heapMallocAligned(Heap*, size_t count, size_t alignment, int fileline, const char* filename);
+void* heapReallocAligned(Heap*, void* memblock, size_t size, size_t alignment, int fileline, const char* filename);
+void* heapCallocAligned(Heap*, size_t number, size_t size, size_t alignment, int fileline, const char* filename);
+size_t heapUsedSpace(Heap*);
+size_t heapLargestUsedBlockSize(Heap*);
+size_t heapFreeSpace(Heap*);
+size_t heapLargestFreeArea(Heap*);
+enum pointer_type_t heapPointerType(Heap*, const void*);
+int heapValidateFields(Heap*);
+int chunkValidate(Heap*, Chunk*, int);
+int heapValidate(Heap*);
+void* validatorMain(void*);
+void threadCacheKeyCreate(void);
+void threadCacheRegister(ThreadCache*);
+void* threadCacheMalloc(size_t);
+void* threadCacheRefill(ThreadCache*, unsigned int, size_t);
+bool threadCacheFree(void*, size_t);
+void threadCacheFlush(ThreadCache*, size_t);
+void threadCacheDestroy(void*);
+int threadCacheValidate(ThreadCache*);
 
 
 int heap_setup(void);
+int heap_set_option(enum heap_option_t option, size_t value);
+
+Arena* heap_arena_create(size_t size);
+void heap_arena_destroy(Arena* arena);
+void* heap_arena_malloc(Arena* arena, size_t count);
+void* heap_arena_calloc(Arena* arena, size_t number, size_t size);
+void heap_thread_set_arena(Arena* arena);
 
+// Thread cached blocks count as used, the same view heap_get_stats gives. Largest sizes are exact
+// until the largest block of a size class goes while others of that class stay, from then on the
+// class's upper bound, narrowed by what the arena holds, stands in until a larger block comes
 size_t heap_get_used_space(void);
 size_t heap_get_largest_used_block_size(void);
 uint64_t heap_get_used_blocks_count(void);
@@ -88,15 +596,25 @@ void *heap_calloc(size_t number, size_t size);
 void *heap_realloc(void* memblock, size_t size);
 void  heap_free(void* memblock);
 void  heap_free_nts(void* memblock);
+// size is what the block was allocated or last reallocated with, debug builds check it
+void  heap_free_sized(void* memblock, size_t size);
+void *heap_realloc_sized(void* memblock, size_t oldSize, size_t size);
+// Fills out with up to count blocks and returns how many it got; heap_free_batch sorts memblocks by address
+size_t heap_malloc_batch(size_t size, size_t count, void** out);
+void  heap_free_batch(void** memblocks, size_t count);
 
 void* heap_malloc_nts_debug(size_t count, int fileline, const char* filename);
 void* heap_calloc_nts_debug(size_t number, size_t size, int fileline, const char* filename);
 void* heap_realloc_nts_debug(void* memblock, size_t size, int fileline, const char* filename);
+void* heap_memalign_nts_debug(size_t alignment, size_t count, int fileline, const char* filename);
 void* heap_calloc_aligned_nts_debug(size_t number, size_t size, int fileline, const char* filename);
 void* heap_malloc_aligned_nts_debug(size_t count, int fileline, const char* filename);
 void* heap_realloc_aligned_nts_debug(void* memblock, size_t size, int fileline, const char* filename);
 
 
+// alignment must be a power of two, heap_malloc_aligned is heap_memalign(PAGE_SIZE, count)
+void* heap_memalign(size_t alignment, size_t size);
+void* heap_aligned_alloc(size_t alignment, size_t size);
 void* heap_malloc_aligned(size_t count);
 void* heap_realloc_aligned(void* memblock, size_t size);
 void* heap_calloc_aligned(size_t number, size_t size);
@@ -105,12 +623,30 @@ void* heap_calloc_aligned(size_t number, size_t size);
 enum pointer_type_t get_pointer_type(const void* pointer);
 void* heap_get_data_block_start(const void* pointer);
 size_t heap_get_block_size(const void* memblock);
+size_t heap_trim(size_t keep);
+int heap_get_stats(struct heap_stats_t* stats);
+size_t heap_profile_get(struct heap_profile_site_t* sites, size_t capacity);
+int heap_profile_dump(const char* path);
+// Writes arenas, chunks, large blocks and a summary to fd as JSON lines. Arena locks are only held
+// while a batch of chunks is copied, so blocks allocated or freed meanwhile may show either state
+int heap_snapshot(int fd);
+// Records every allocation and free to fd until heap_trace_stop, see struct heap_trace_record_t
+int heap_trace_start(int fd);
+int heap_trace_stop(void);
 int heap_validate(void);
+// Checks up to budget chunks of one shared arena under its lock, then returns. Each call goes on
+// where the last one stopped: 1 when it finished a pass over every shared arena, -1 on damage
+int heap_validate_step(size_t budget);
+// Runs heap_validate_step(budget) on a background thread every intervalUs microseconds
+int heap_validator_start(size_t budget, unsigned int intervalUs);
+// Stops the thread, -1 when it found damage since heap_validator_start
+int heap_validator_stop(void);
 void heap_dump_debug_information(void);
 
 void* heap_malloc_ts_debug(size_t count, int fileline, const char* filename);
 void* heap_calloc_ts_debug(size_t number, size_t size, int fileline, const char* filename);
 void* heap_realloc_ts_debug(void* memblock, size_t size, int fileline, const char* filename);
+void* heap_memalign_ts_debug(size_t alignment, size_t count, int fileline, const char* filename);
 void* heap_calloc_aligned_ts_debug(size_t number, size_t size, int fileline, const char* filename);
 void* heap_malloc_aligned_ts_debug(size_t count, int fileline, const char* filename);
 void* heap_realloc_aligned_ts_debug(void* memblock, size_t size, int fileline, const char* filename);
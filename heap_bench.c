@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "heap.h"
+
+// Allocator workloads run against heap_* and against the system malloc, one child process per run
+// so peak RSS belongs to a single allocator. Seeds are fixed, so reports of two commits compare.
+// Build it like main.c: gcc -O2 heap_bench.c heap.c custom_unistd.c -lpthread, with the same
+// HEAP_COMPACT_HEADER / NDEBUG / HEAP_NO_CHECKSUM flags on both sides of a comparison.
+// Usage: heap_bench [operations] [threads] [workload], HEAP_PLACEMENT=<placement_policy_t> picks the policy,
+//        HEAP_DEFERRED_COALESCING=<bytes> parks small frees, HEAP_ADAPTIVE_LOCKS=1 spins before sleeping
+
+#define SLOTS 8192
+#define LATENCY_EVERY 8 // every 8th operation is timed
+#define LATENCY_SAMPLES (1 << 20)
+#define MAX_THREADS 64
+
+typedef struct Allocator{
+    const char* name;
+    int (*setup)(void);
+    void* (*malloc)(size_t);
+    void (*free)(void*);
+    void* (*realloc)(void*, size_t);
+    void* (*memalign)(size_t, size_t);
+    size_t (*footprint)(void);
+}Allocator;
+
+typedef struct Latency{
+    uint32_t* samples; // nanoseconds, mapped so they don't count as allocator memory
+    size_t count;
+}Latency;
+
+typedef struct Worker{
+    const Allocator* allocator;
+    unsigned int seed;
+    size_t operations;
+    Latency latency;
+    size_t liveBytes;
+    void** slots;
+    size_t* sizes;
+}Worker;
+
+typedef struct Report{
+    size_t operations;
+    double seconds;
+    size_t liveBytes; // requested bytes still allocated at the measuring point
+    size_t footprint; // memory the allocator took for them
+}Report;
+
+int systemSetup(void)
+{
+    return 0;
+}
+void* systemMemalign(size_t alignment, size_t size)
+{
+    void* memory;
+    return posix_memalign(&memory, alignment, size) == 0 ? memory : NULL;
+}
+size_t systemFootprint(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+int heapSetup(void)
+{
+    // Policy and lock type have to be set before the first arena exists
+    const char* placement = getenv("HEAP_PLACEMENT");
+    if(placement != NULL && heap_set_option(option_placement_policy, strtoull(placement, NULL, 10)) != 0)
+        return -1;
+    const char* adaptive = getenv("HEAP_ADAPTIVE_LOCKS");
+    if(adaptive != NULL && heap_set_option(option_adaptive_locks, strtoull(adaptive, NULL, 10)) != 0)
+        return -1;
+    if(heap_setup() != 0)
+        return -1;
+    const char* deferred = getenv("HEAP_DEFERRED_COALESCING");
+    return deferred != NULL ? heap_set_option(option_deferred_coalescing, strtoull(deferred, NULL, 10)) : 0;
+}
+size_t heapFootprint(void)
+{
+    struct heap_stats_t stats;
+    return heap_get_stats(&stats) == 0 ? stats.osBytes : 0;
+}
+
+const Allocator allocators[] = {
+    { "heap", heapSetup, heap_malloc, heap_free, heap_realloc, heap_memalign, heapFootprint },
+    { "system", systemSetup, malloc, free, realloc, systemMemalign, systemFootprint },
+};
+
+double nowNs(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+void* mapZeroed(size_t size)
+{
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    return memory;
+}
+void latencyRecord(Latency* latency, double start)
+{
+    if(latency->count < LATENCY_SAMPLES)
+        latency->samples[latency->count++] = (uint32_t)(nowNs() - start);
+}
+size_t randomSize(unsigned int* seed)
+{
+    // Mostly small blocks, a tail of bigger ones
+    unsigned int roll = rand_r(seed) % 100;
+    if(roll < 70)
+        return 8 + rand_r(seed) % 248;
+    if(roll < 95)
+        return 256 + rand_r(seed) % 3840;
+    return 4096 + rand_r(seed) % 61440;
+}
+void workerSetup(Worker* worker, const Allocator* allocator, unsigned int seed, size_t operations)
+{
+    worker->allocator = allocator;
+    worker->seed = seed;
+    worker->operations = operations;
+    worker->latency.samples = mapZeroed(LATENCY_SAMPLES * sizeof(uint32_t));
+    worker->latency.count = 0;
+    worker->liveBytes = 0;
+    worker->slots = mapZeroed(SLOTS * sizeof(void*));
+    worker->sizes = mapZeroed(SLOTS * sizeof(size_t));
+}
+void workerChurn(Worker* worker, size_t operations)
+{
+    // Random slot: allocate it when empty, free it otherwise
+    const Allocator* allocator = worker->allocator;
+    for(size_t i = 0; i < operations; ++i)
+    {
+        unsigned int slot = rand_r(&worker->seed) % SLOTS;
+        bool timed = i % LATENCY_EVERY == 0;
+        double start = timed ? nowNs() : 0;
+        if(worker->slots[slot] == NULL)
+        {
+            size_t size = randomSize(&worker->seed);
+            worker->slots[slot] = allocator->malloc(size);
+            if(timed)
+                latencyRecord(&worker->latency, start);
+            if(worker->slots[slot] != NULL)
+            {
+                memset(worker->slots[slot], (int)i, size < 64 ? size : 64);
+                worker->sizes[slot] = size;
+                worker->liveBytes += size;
+            }
+        }
+        else
+        {
+            allocator->free(worker->slots[slot]);
+            if(timed)
+                latencyRecord(&worker->latency, start);
+            worker->liveBytes -= worker->sizes[slot];
+            worker->slots[slot] = NULL;
+        }
+    }
+}
+void workerRelease(Worker* worker)
+{
+    for(size_t slot = 0; slot < SLOTS; ++slot)
+        if(worker->slots[slot] != NULL)
+            worker->allocator->free(worker->slots[slot]);
+    memset(worker->slots, 0, SLOTS * sizeof(void*));
+    worker->liveBytes = 0;
+}
+
+void runChurn(Worker* workers, unsigned int threads, Report* report)
+{
+    (void)threads;
+    workerChurn(&workers[0], workers[0].operations);
+    report->operations = workers[0].operations;
+    report->liveBytes = workers[0].liveBytes;
+    report->footprint = workers[0].allocator->footprint();
+    workerRelease(&workers[0]);
+}
+
+void runRealloc(Worker* workers, unsigned int threads, Report* report)
+{
+    // Buffers grow by random steps up to 1MB, then start over
+    (void)threads;
+    Worker* worker = &workers[0];
+    const Allocator* allocator = worker->allocator;
+    enum { BUFFERS = 64 };
+    for(size_t i = 0; i < worker->operations; ++i)
+    {
+        unsigned int slot = rand_r(&worker->seed) % BUFFERS;
+        size_t size = worker->sizes[slot] + 16 + rand_r(&worker->seed) % (worker->sizes[slot] / 4 + 64);
+        if(size > (1 << 20))
+            size = 16;
+        bool timed = i % LATENCY_EVERY == 0;
+        double start = timed ? nowNs() : 0;
+        void* memory = allocator->realloc(worker->slots[slot], size);
+        if(timed)
+            latencyRecord(&worker->latency, start);
+        if(memory == NULL)
+            continue;
+        ((uint8_t*)memory)[size - 1] = (uint8_t)i;
+        worker->liveBytes += size - worker->sizes[slot];
+        worker->slots[slot] = memory;
+        worker->sizes[slot] = size;
+    }
+    report->operations = worker->operations;
+    report->liveBytes = worker->liveBytes;
+    report->footprint = allocator->footprint();
+    workerRelease(worker);
+}
+
+void runAligned(Worker* workers, unsigned int threads, Report* report)
+{
+    // Plain and aligned requests mixed, alignments from 32 to 4096 bytes
+    (void)threads;
+    Worker* worker = &workers[0];
+    const Allocator* allocator = worker->allocator;
+    for(size_t i = 0; i < worker->operations; ++i)
+    {
+        unsigned int slot = rand_r(&worker->seed) % SLOTS;
+        bool timed = i % LATENCY_EVERY == 0;
+        double start = timed ? nowNs() : 0;
+        if(worker->slots[slot] == NULL)
+        {
+            size_t size = randomSize(&worker->seed);
+            unsigned int shift = rand_r(&worker->seed) % 10;
+            worker->slots[slot] = shift < 2 ? allocator->malloc(size) : allocator->memalign((size_t)8 << shift, size);
+            if(timed)
+                latencyRecord(&worker->latency, start);
+            if(worker->slots[slot] != NULL)
+            {
+                worker->sizes[slot] = size;
+                worker->liveBytes += size;
+            }
+        }
+        else
+        {
+            allocator->free(worker->slots[slot]);
+            if(timed)
+                latencyRecord(&worker->latency, start);
+            worker->liveBytes -= worker->sizes[slot];
+            worker->slots[slot] = NULL;
+        }
+    }
+    report->operations = worker->operations;
+    report->liveBytes = worker->liveBytes;
+    report->footprint = allocator->footprint();
+    workerRelease(worker);
+}
+
+// Producer/consumer: blocks are allocated by one thread and freed by another
+typedef struct Ring{
+    _Atomic(void*) blocks[1024];
+    atomic_size_t head;
+    atomic_size_t tail;
+}Ring;
+
+typedef struct Pair{
+    Worker* worker;
+    Ring* ring;
+}Pair;
+
+void* producer(void* arg)
+{
+    Pair* pair = arg;
+    Worker* worker = pair->worker;
+    Ring* ring = pair->ring;
+    for(size_t i = 0; i < worker->operations; ++i)
+    {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        while(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == 1024)
+            sched_yield();
+        bool timed = i % LATENCY_EVERY == 0;
+        double start = timed ? nowNs() : 0;
+        void* memory = worker->allocator->malloc(randomSize(&worker->seed));
+        if(timed)
+            latencyRecord(&worker->latency, start);
+        atomic_store_explicit(&ring->blocks[head % 1024], memory, memory_order_relaxed);
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
+    return NULL;
+}
+void* consumer(void* arg)
+{
+    Pair* pair = arg;
+    Worker* worker = pair->worker;
+    Ring* ring = pair->ring;
+    for(size_t i = 0; i < worker->operations; ++i)
+    {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while(atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+            sched_yield();
+        void* memory = atomic_load_explicit(&ring->blocks[tail % 1024], memory_order_relaxed);
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        bool timed = i % LATENCY_EVERY == 0;
+        double start = timed ? nowNs() : 0;
+        worker->allocator->free(memory);
+        if(timed)
+            latencyRecord(&worker->latency, start);
+    }
+    return NULL;
+}
+void runProducerConsumer(Worker* workers, unsigned int threads, Report* report)
+{
+    // Threads pair up, an odd one out stays idle
+    unsigned int pairs = threads / 2;
+    size_t operations = workers[0].operations / pairs;
+    Ring* rings = mapZeroed(pairs * sizeof(Ring));
+    Pair arguments[MAX_THREADS];
+    pthread_t handles[MAX_THREADS];
+    for(unsigned int i = 0; i < 2 * pairs; ++i)
+    {
+        arguments[i].worker = &workers[i];
+        arguments[i].ring = &rings[i / 2];
+        workers[i].operations = operations;
+        pthread_create(&handles[i], NULL, i % 2 ? consumer : producer, &arguments[i]);
+    }
+    for(unsigned int i = 0; i < 2 * pairs; ++i)
+        pthread_join(handles[i], NULL);
+    report->operations = 2 * pairs * operations;
+    report->footprint = workers[0].allocator->footprint();
+    munmap(rings, pairs * sizeof(Ring));
+}
+
+// Larson-style: every thread churns its own slots, then hands them to the next thread, whose
+// frees then land in blocks allocated elsewhere
+#define LARSON_ROUNDS 8
+pthread_barrier_t larsonBarrier;
+Worker* larsonWorkers;
+unsigned int larsonThreads;
+
+void* larsonThread(void* arg)
+{
+    Worker* worker = arg;
+    size_t operations = worker->operations / LARSON_ROUNDS;
+    for(int round = 0; round < LARSON_ROUNDS; ++round)
+    {
+        workerChurn(worker, operations);
+        pthread_barrier_wait(&larsonBarrier);
+        if(worker == &larsonWorkers[0])
+        {
+            // Rotate slot tables (and their byte counts) one thread over
+            Worker last = larsonWorkers[larsonThreads - 1];
+            for(unsigned int i = larsonThreads - 1; i > 0; --i)
+            {
+                larsonWorkers[i].slots = larsonWorkers[i - 1].slots;
+                larsonWorkers[i].sizes = larsonWorkers[i - 1].sizes;
+                larsonWorkers[i].liveBytes = larsonWorkers[i - 1].liveBytes;
+            }
+            larsonWorkers[0].slots = last.slots;
+            larsonWorkers[0].sizes = last.sizes;
+            larsonWorkers[0].liveBytes = last.liveBytes;
+        }
+        pthread_barrier_wait(&larsonBarrier);
+    }
+    return NULL;
+}
+void runLarson(Worker* workers, unsigned int threads, Report* report)
+{
+    pthread_t handles[MAX_THREADS];
+    larsonWorkers = workers;
+    larsonThreads = threads;
+    pthread_barrier_init(&larsonBarrier, NULL, threads);
+    for(unsigned int i = 0; i < threads; ++i)
+    {
+        workers[i].operations = workers[0].operations;
+        pthread_create(&handles[i], NULL, larsonThread, &workers[i]);
+    }
+    for(unsigned int i = 0; i < threads; ++i)
+        pthread_join(handles[i], NULL);
+    pthread_barrier_destroy(&larsonBarrier);
+    report->operations = threads * (workers[0].operations / LARSON_ROUNDS * LARSON_ROUNDS);
+    for(unsigned int i = 0; i < threads; ++i)
+        report->liveBytes += workers[i].liveBytes;
+    report->footprint = workers[0].allocator->footprint();
+    for(unsigned int i = 0; i < threads; ++i)
+        workerRelease(&workers[i]);
+}
+
+typedef struct Workload{
+    const char* name;
+    void (*run)(Worker*, unsigned int, Report*);
+    bool isThreaded;
+}Workload;
+
+const Workload workloads[] = {
+    { "churn", runChurn, false },
+    { "prodcons", runProducerConsumer, true },
+    { "larson", runLarson, true },
+    { "realloc", runRealloc, false },
+    { "aligned", runAligned, false },
+};
+
+int compareSamples(const void* first, const void* second)
+{
+    uint32_t a = *(const uint32_t*)first;
+    uint32_t b = *(const uint32_t*)second;
+    return (a > b) - (a < b);
+}
+void runWorkload(const Workload* workload, const Allocator* allocator, size_t operations, unsigned int threads)
+{
+    // Child process: fresh allocator, its own peak RSS
+    if(allocator->setup() != 0)
+    {
+        printf("%-10s %-8s setup failed\n", workload->name, allocator->name);
+        exit(1);
+    }
+    unsigned int count = workload->isThreaded ? threads : 1;
+    Worker workers[MAX_THREADS];
+    for(unsigned int i = 0; i < count; ++i)
+        workerSetup(&workers[i], allocator, 12345 + i, operations);
+
+    Report report = { 0 };
+    double start = nowNs();
+    workload->run(workers, count, &report);
+    report.seconds = (nowNs() - start) / 1e9;
+
+    // Merge every thread's samples into the first buffer, up to its size
+    Latency* latency = &workers[0].latency;
+    for(unsigned int i = 1; i < count; ++i)
+    {
+        size_t take = workers[i].latency.count;
+        if(take > LATENCY_SAMPLES - latency->count)
+            take = LATENCY_SAMPLES - latency->count;
+        memcpy(latency->samples + latency->count, workers[i].latency.samples, take * sizeof(uint32_t));
+        latency->count += take;
+    }
+    qsort(latency->samples, latency->count, sizeof(uint32_t), compareSamples);
+    uint32_t p50 = 0, p99 = 0, p999 = 0;
+    if(latency->count)
+    {
+        p50 = latency->samples[latency->count * 500 / 1000];
+        p99 = latency->samples[latency->count * 990 / 1000];
+        p999 = latency->samples[latency->count * 999 / 1000];
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double fragmentation = report.footprint > report.liveBytes && report.liveBytes ? 1.0 - (double)report.liveBytes / report.footprint : 0;
+    printf("%-10s %-8s %12.0f %8u %8u %8u %10ld %8.3f\n", workload->name, allocator->name, report.operations / report.seconds,
+           p50, p99, p999, usage.ru_maxrss, fragmentation);
+    fflush(stdout);
+    exit(0);
+}
+
+int main(int argc, char** argv)
+{
+    size_t operations = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    unsigned int threads = argc > 2 ? atoi(argv[2]) : 4;
+    const char* only = argc > 3 ? argv[3] : NULL;
+    if(operations == 0 || threads < 2 || threads > MAX_THREADS)
+    {
+        printf("Usage: %s [operations] [threads 2-%d] [workload]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+    printf("%-10s %-8s %12s %8s %8s %8s %10s %8s\n", "workload", "alloc", "ops/s", "p50 ns", "p99 ns", "p999 ns", "rss KB", "frag");
+    fflush(stdout);
+    for(size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); ++w)
+    {
+        if(only != NULL && strcmp(only, workloads[w].name) != 0)
+            continue;
+        for(size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); ++a)
+        {
+            pid_t child = fork();
+            if(child == 0)
+                runWorkload(&workloads[w], &allocators[a], operations, threads);
+            int status;
+            if(child < 0 || waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                printf("%-10s %-8s failed\n", workloads[w].name, allocators[a].name);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "heap.h"
+
+// Replays a heap_trace_start trace on one thread, in time order, against heap_* or the system malloc,
+// and reports per-call latency, peak footprint and fragmentation. Same trace, same calls, every run.
+// Build it like main.c: gcc -O2 heap_replay.c heap.c custom_unistd.c -lpthread
+// Usage: heap_replay <trace> [heap|system], HEAP_PLACEMENT=<placement_policy_t> picks the policy,
+//        HEAP_DEFERRED_COALESCING=<bytes> parks small frees
+
+// Footprint is sampled every this many records, fragmentation peaks while live bytes are below theirs
+#define FOOTPRINT_INTERVAL 64
+
+typedef struct Backend{
+    const char* name;
+    int (*setup)(void);
+    void* (*malloc)(size_t);
+    void* (*calloc)(size_t, size_t);
+    void* (*realloc)(void*, size_t);
+    void (*free)(void*);
+    void* (*memalign)(size_t, size_t);
+    size_t (*footprint)(void);
+}Backend;
+
+// Live blocks by trace id. An id can be live twice for a moment, when a thread reused an address
+// before the free that released it was recorded, so entries of one id are kept in FIFO order
+typedef struct Block{
+    uint64_t id;
+    void* memory;
+    size_t size;
+    struct Block* next;
+}Block;
+
+typedef struct Blocks{
+    Block** heads;
+    Block** tails;
+    size_t mask;
+    Block* pool;
+    Block* unused;
+    size_t liveBytes;
+}Blocks;
+
+int systemSetup(void)
+{
+    return 0;
+}
+void* systemMemalign(size_t alignment, size_t size)
+{
+    void* memory;
+    return posix_memalign(&memory, alignment, size) == 0 ? memory : NULL;
+}
+size_t systemFootprint(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+int heapSetup(void)
+{
+    // The policy has to be in place before the first arena exists
+    const char* placement = getenv("HEAP_PLACEMENT");
+    if(placement != NULL && heap_set_option(option_placement_policy, strtoull(placement, NULL, 10)) != 0)
+        return -1;
+    if(heap_setup() != 0)
+        return -1;
+    const char* deferred = getenv("HEAP_DEFERRED_COALESCING");
+    return deferred != NULL ? heap_set_option(option_deferred_coalescing, strtoull(deferred, NULL, 10)) : 0;
+}
+size_t heapFootprint(void)
+{
+    struct heap_stats_t stats;
+    return heap_get_stats(&stats) == 0 ? stats.osBytes : 0;
+}
+
+const Backend backends[] = {
+    { "heap", heapSetup, heap_malloc, heap_calloc, heap_realloc, heap_free, heap_memalign, heapFootprint },
+    { "system", systemSetup, malloc, calloc, realloc, free, systemMemalign, systemFootprint },
+};
+
+double nowNs(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+void* mapZeroed(size_t size)
+{
+    // Replay bookkeeping stays out of the allocator under test
+    void* memory = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    return memory;
+}
+size_t blockHash(uint64_t id, size_t mask)
+{
+    return (size_t)((id * 0x9E3779B97F4A7C15ULL) >> 20) & mask;
+}
+void blocksSetup(Blocks* blocks, size_t records)
+{
+    size_t buckets = 1024;
+    while(buckets < 2 * records)
+        buckets *= 2;
+    blocks->heads = mapZeroed(buckets * sizeof(Block*));
+    blocks->tails = mapZeroed(buckets * sizeof(Block*));
+    blocks->mask = buckets - 1;
+    // Every record adds at most one live block
+    blocks->pool = mapZeroed(records * sizeof(Block));
+    blocks->unused = NULL;
+    for(size_t i = records; i > 0; --i)
+    {
+        blocks->pool[i - 1].next = blocks->unused;
+        blocks->unused = &blocks->pool[i - 1];
+    }
+    blocks->liveBytes = 0;
+}
+void blocksInsert(Blocks* blocks, uint64_t id, void* memory, size_t size)
+{
+    size_t bucket = blockHash(id, blocks->mask);
+    Block* block = blocks->unused;
+    blocks->unused = block->next;
+    block->id = id;
+    block->memory = memory;
+    block->size = size;
+    block->next = NULL;
+    if(blocks->tails[bucket] != NULL)
+        blocks->tails[bucket]->next = block;
+    else
+        blocks->heads[bucket] = block;
+    blocks->tails[bucket] = block;
+    blocks->liveBytes += size;
+}
+bool blocksRemove(Blocks* blocks, uint64_t id, void** memory)
+{
+    // Oldest entry of id, false when the block was allocated before the trace started
+    size_t bucket = blockHash(id, blocks->mask);
+    Block* previous = NULL;
+    for(Block* block = blocks->heads[bucket]; block != NULL; previous = block, block = block->next)
+    {
+        if(block->id != id)
+            continue;
+        if(previous != NULL)
+            previous->next = block->next;
+        else
+            blocks->heads[bucket] = block->next;
+        if(blocks->tails[bucket] == block)
+            blocks->tails[bucket] = previous;
+        *memory = block->memory;
+        blocks->liveBytes -= block->size;
+        block->next = blocks->unused;
+        blocks->unused = block;
+        return true;
+    }
+    return false;
+}
+
+int compareRecords(const void* first, const void* second)
+{
+    // Thread runs are written in order, ties keep their file position
+    const struct heap_trace_record_t* a = *(struct heap_trace_record_t* const*)first;
+    const struct heap_trace_record_t* b = *(struct heap_trace_record_t* const*)second;
+    if(a->time != b->time)
+        return (a->time > b->time) - (a->time < b->time);
+    return (a > b) - (a < b);
+}
+int compareLatencies(const void* first, const void* second)
+{
+    uint32_t a = *(const uint32_t*)first;
+    uint32_t b = *(const uint32_t*)second;
+    return (a > b) - (a < b);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        printf("Usage: %s <trace> [heap|system]\n", argv[0]);
+        return 1;
+    }
+    const Backend* backend = &backends[0];
+    if(argc > 2 && strcmp(argv[2], "system") == 0)
+        backend = &backends[1];
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0 || info.st_size < 8)
+    {
+        printf("%s : Couldn't read the trace\n", argv[1]);
+        return 1;
+    }
+    uint8_t* file = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(file == MAP_FAILED || memcmp(file, HEAP_TRACE_MAGIC, 8) != 0)
+    {
+        printf("%s : Not a heap trace\n", argv[1]);
+        return 1;
+    }
+    size_t count = (info.st_size - 8) / sizeof(struct heap_trace_record_t);
+    struct heap_trace_record_t* records = (struct heap_trace_record_t*)(file + 8);
+    struct heap_trace_record_t** order = mapZeroed(count * sizeof(*order));
+    for(size_t i = 0; i < count; ++i)
+        order[i] = &records[i];
+    qsort(order, count, sizeof(*order), compareRecords);
+
+    if(backend->setup() != 0)
+    {
+        printf("%s : Setup failed\n", backend->name);
+        return 1;
+    }
+    Blocks blocks;
+    blocksSetup(&blocks, count);
+    uint32_t* latencies = mapZeroed(count * sizeof(uint32_t));
+    size_t failed = 0, unmatched = 0, peakFootprint = 0, peakLive = 0, timed = 0;
+    double total = 0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        struct heap_trace_record_t* record = order[i];
+        void* memory = NULL;
+        void* old = NULL;
+        double start;
+        switch(record->op)
+        {
+            case trace_malloc:
+            case trace_calloc:
+            case trace_memalign:
+                start = nowNs();
+                if(record->op == trace_malloc)
+                    memory = backend->malloc(record->size);
+                else if(record->op == trace_calloc && record->alignmentShift == 0)
+                    memory = backend->calloc(1, record->size);
+                else
+                    memory = backend->memalign((size_t)1 << record->alignmentShift, record->size);
+                latencies[timed++] = (uint32_t)(nowNs() - start);
+                if(memory == NULL)
+                    failed++;
+                else
+                {
+                    if(record->op == trace_calloc && record->alignmentShift != 0)
+                        memset(memory, 0, record->size);
+                    blocksInsert(&blocks, record->id, memory, record->size);
+                }
+                break;
+            case trace_realloc:
+                // A block from before the trace started is replayed as a new one, alignment isn't kept
+                if(record->oldId != 0 && !blocksRemove(&blocks, record->oldId, &old))
+                    unmatched++;
+                if(old == NULL && record->size == 0)
+                    break;
+                start = nowNs();
+                memory = backend->realloc(old, record->size);
+                latencies[timed++] = (uint32_t)(nowNs() - start);
+                if(memory != NULL)
+                    blocksInsert(&blocks, record->id, memory, record->size);
+                else if(record->size != 0)
+                    failed++;
+                break;
+            case trace_free:
+                if(!blocksRemove(&blocks, record->id, &old))
+                {
+                    unmatched++;
+                    break;
+                }
+                start = nowNs();
+                backend->free(old);
+                latencies[timed++] = (uint32_t)(nowNs() - start);
+                break;
+            default:
+                printf("%s : Record %zu has an unknown op\n", argv[1], i);
+                return 1;
+        }
+        bool newPeak = blocks.liveBytes > peakLive;
+        if(newPeak)
+            peakLive = blocks.liveBytes;
+        if(newPeak || i % FOOTPRINT_INTERVAL == 0)
+        {
+            size_t footprint = backend->footprint();
+            if(footprint > peakFootprint)
+                peakFootprint = footprint;
+        }
+    }
+    size_t footprint = backend->footprint();
+    if(footprint > peakFootprint)
+        peakFootprint = footprint;
+    size_t liveBytes = blocks.liveBytes;
+    // Unmatched frees and skipped records weren't timed, they stay out of the percentiles
+    for(size_t i = 0; i < timed; ++i)
+        total += latencies[i];
+    qsort(latencies, timed, sizeof(uint32_t), compareLatencies);
+    printf("backend %s, %zu records (%zu failed, %zu unmatched, %zu timed)\n", backend->name, count, failed, unmatched, timed);
+    if(timed)
+        printf("latency ns: mean %.0f p50 %u p99 %u p999 %u max %u\n", total / timed, latencies[timed * 500 / 1000],
+               latencies[timed * 990 / 1000], latencies[timed * 999 / 1000], latencies[timed - 1]);
+    printf("peak live %zu bytes, peak footprint %zu bytes\n", peakLive, peakFootprint);
+    printf("end: live %zu bytes, footprint %zu bytes, fragmentation %.3f\n", liveBytes, footprint,
+           footprint > liveBytes && liveBytes ? 1.0 - (double)liveBytes / footprint : 0);
+    return 0;
+}
@@ -1,6 +1,10 @@
 #include <stdio.h>
+#include <string.h>
 #include "heap.h"
+#include "custom_unistd.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define PAGE_SIZE 4096
 
@@ -50,7 +54,7 @@ int main()
     assert(thirdBlock == NULL);
 
 
-    thirdBlock = heap_malloc(3656);
+    thirdBlock = heap_malloc(2 * PAGE_SIZE - 5 * sizeof(Chunk) - 16 - 4200); // exactly what is left on the second page
     assert(heap_get_free_gaps_count() == 0); // true because all blocks are used
     assert(heap_get_used_blocks_count() == 5); // as above
 
@@ -122,5 +126,281 @@ int main()
     assert((heap_get_used_space() + heap_get_free_space()) % PAGE_SIZE == 0); // size must be divisible by PAGE_SIZE
     assert(heap_get_used_blocks_count() == 2 && heap_get_free_gaps_count() == 1);
 
+    heap_set_option(option_thread_cache_limit, 1024);
+    firstBlock = heap_malloc(24); // refills thread cache with a batch of blocks
+    assert(firstBlock != NULL);
+    uint64_t cachedUsed = heap_get_used_blocks_count();
+    assert(cachedUsed > 3); // the rest of the batch waits in the cache
+    heap_free(firstBlock); // stays in thread cache
+    assert(heap_get_used_blocks_count() == cachedUsed); // cached blocks stay used until flushed
+    assert(heap_validate() == 0);
+    assert(heap_malloc(24) == firstBlock); // served from thread cache
+
+    Arena* arena = heap_arena_create(PAGE_SIZE * 16);
+    assert(arena != NULL);
+    firstBlock = heap_arena_malloc(arena, 100);
+    assert(firstBlock != NULL);
+    assert(get_pointer_type(firstBlock) == pointer_valid); // private arenas are known to the heap
+    assert(get_pointer_type((Chunk*)firstBlock - 1) == pointer_control_block);
+    assert(heap_get_data_block_start((uint8_t*)firstBlock + 50) == firstBlock); // found through the chunk map
+    heap_free(firstBlock);
+    assert(heap_arena_malloc(arena, 100) == firstBlock); // first fit reuses the freed block
+    assert(heap_validate() == 0);
+    heap_arena_destroy(arena); // drops every block at once
+
+    Arena* arenas[PRIVATE_ARENA_SLOTS + 1];
+    for(int i = 0; i <= PRIVATE_ARENA_SLOTS; ++i)
+        assert((arenas[i] = heap_arena_create(PAGE_SIZE * 4)) != NULL);
+    firstBlock = heap_arena_malloc(arenas[PRIVATE_ARENA_SLOTS], 100); // past the published ranges
+    assert(get_pointer_type(firstBlock) == pointer_valid);
+    heap_free(firstBlock);
+    assert(heap_arena_malloc(arenas[PRIVATE_ARENA_SLOTS], 100) == firstBlock);
+    heap_arena_destroy(arenas[0]);
+    arena = heap_arena_create(PAGE_SIZE * 4); // takes the emptied range
+    secondBlock = heap_arena_malloc(arena, 100);
+    heap_free(secondBlock);
+    assert(heap_arena_malloc(arena, 100) == secondBlock);
+    assert(heap_validate() == 0);
+    heap_arena_destroy(arena);
+    for(int i = 1; i <= PRIVATE_ARENA_SLOTS; ++i)
+        heap_arena_destroy(arenas[i]);
+
+    heap_set_option(option_arena_count, 2);
+    Arena* shared = poolArena(1);
+    heap_thread_set_arena(shared);
+    firstBlock = heap_malloc(300);
+    secondBlock = heap_malloc(300);
+    arena = heap_arena_create(PAGE_SIZE * 4);
+    heap_thread_set_arena(arena); // blocks of the shared arena are queued for it from now on
+    ((uintptr_t*)firstBlock)[1] = (uintptr_t)shared ^ RANDOM_FENCE_VALUE; // data that looks queued
+    heap_free(firstBlock);
+    assert(get_pointer_type(firstBlock) == pointer_unallocated); // freed, not taken for a double free
+    heap_free(secondBlock); // queued
+    heap_free(secondBlock); // log: Double free deteched
+    assert(get_pointer_type(secondBlock) == pointer_unallocated);
+    heap_thread_set_arena(NULL);
+    heap_arena_destroy(arena);
+    heap_set_option(option_arena_count, 1);
+    assert(heap_validate() == 0);
+
+    heap_set_option(option_thread_cache_limit, 0);
+    heap_set_option(option_slab_allocator, 1);
+    uint64_t usedBlocks = heap_get_used_blocks_count();
+    firstBlock = heap_malloc(40);
+    secondBlock = heap_malloc(40);
+    assert(heap_get_used_blocks_count() == usedBlocks + 1); // both blocks share one slab chunk
+    assert((uint8_t*)secondBlock - (uint8_t*)firstBlock == 40); // slots have no headers
+    assert(heap_get_block_size(secondBlock) == 40);
+    heap_free(firstBlock);
+    heap_free(firstBlock); // log: Double free deteched
+    heap_free(secondBlock);
+    assert(heap_validate() == 0);
+
+    size_t heapSize = heap_get_used_space() + heap_get_free_space();
+    firstBlock = heap_malloc(8 * PAGE_SIZE); // heap grows at the tail
+    heap_free(firstBlock);
+    assert(heap_trim(0) >= 8 * PAGE_SIZE); // trailing free pages go back to the OS
+    assert(heap_get_used_space() + heap_get_free_space() <= heapSize);
+    assert((heap_get_used_space() + heap_get_free_space()) % PAGE_SIZE == 0);
+    assert(heap_validate() == 0);
+
+    heap_set_option(option_mmap_threshold, 16 * PAGE_SIZE);
+    heapSize = heap_get_used_space() + heap_get_free_space();
+    firstBlock = heap_malloc(100000); // served from its own mapping
+    assert(firstBlock != NULL);
+    assert(heap_get_used_space() + heap_get_free_space() == heapSize + 25 * PAGE_SIZE); // heap itself didn't grow
+    assert(get_pointer_type(firstBlock) == pointer_valid);
+    assert(heap_get_block_size(firstBlock) == 100000);
+    assert(heap_get_data_block_start((uint8_t*)firstBlock + 5000) == firstBlock);
+    assert(heap_get_data_block_start(firstBlock) == firstBlock);
+    assert(heap_get_data_block_start((uint8_t*)firstBlock + 101000) == NULL); // mapped, past the block
+    firstBlock = heap_realloc(firstBlock, 200000); // remapped
+    assert(firstBlock != NULL && heap_get_block_size(firstBlock) == 200000);
+    assert(heap_get_largest_used_block_size() == 200000); // large blocks publish their largest size too
+    assert(heap_validate() == 0);
+    heap_free(firstBlock); // unmapped at once
+    assert(heap_get_used_space() + heap_get_free_space() == heapSize);
+    assert(heap_get_largest_used_block_size() < 200000);
+    heap_set_option(option_mmap_threshold, 0);
+
+    firstBlock = heap_malloc(60000); // a size class nothing else is in
+    secondBlock = heap_malloc(60000);
+    void* narrowBlock = heap_malloc(40000);
+    assert(heap_get_largest_used_block_size() == 60000);
+    heap_free(firstBlock);
+    assert(heap_get_largest_used_block_size() == 60000); // the other one of that size keeps it exact
+    heap_free(secondBlock);
+    assert(heap_get_largest_used_block_size() == 40000); // alone in its class, so its bytes give it away
+    void* wideBlock = heap_malloc(50000);
+    assert(heap_get_largest_used_block_size() >= 50000 && heap_get_largest_used_block_size() < 65536); // bound of the class
+    heap_free(wideBlock);
+    heap_free(narrowBlock);
+    assert(heap_validate() == 0);
+
+    assert(heap_memalign(48, 100) == NULL); // log: Invalid alignment
+    heapSize = heap_get_used_space() + heap_get_free_space();
+    firstBlock = heap_memalign(64, 100);
+    assert(firstBlock != NULL && ((intptr_t)firstBlock & 63) == 0);
+    secondBlock = heap_aligned_alloc(1 << 21, 100); // huge page alignment
+    assert(secondBlock != NULL && ((intptr_t)secondBlock & ((1 << 21) - 1)) == 0);
+    assert(heap_get_used_space() + heap_get_free_space() < heapSize + (1 << 22)); // heap grew once, by the padding it needs
+    assert(heap_get_free_gaps_count() >= 2); // leading gaps went back to the bins
+    secondBlock = heap_realloc_aligned(secondBlock, 200); // grows in place, stays aligned
+    assert(((intptr_t)secondBlock & (PAGE_SIZE - 1)) == 0);
+    heap_free(firstBlock);
+    heap_free(secondBlock);
+    assert(heap_validate() == 0);
+
+    heap_set_option(option_slab_allocator, 0);
+    void* batch[64];
+    usedBlocks = heap_get_used_blocks_count();
+    assert(heap_malloc_batch(300, 64, batch) == 64);
+    assert(heap_get_used_blocks_count() == usedBlocks + 64);
+    assert((uint8_t*)batch[63] - (uint8_t*)batch[0] == 63 * (304 + sizeof(Chunk))); // carved as one run
+    firstBlock = batch[5];
+    batch[5] = NULL; // skipped
+    heap_free(batch[6]);
+    batch[6] = batch[7]; // log: Invalid chunk <not exists>, first copy merged it with the free neighbour
+    heap_free_batch(batch, 64);
+    assert(heap_get_used_blocks_count() == usedBlocks + 1);
+    heap_free(firstBlock);
+    assert(heap_validate() == 0);
+
+    firstBlock = heap_malloc(100);
+    assert(heap_realloc_sized(firstBlock, 100, 103) == firstBlock); // same size class
+    heap_free_sized(firstBlock, 100);
+    assert(heap_get_used_blocks_count() == usedBlocks);
+    firstBlock = heap_malloc(100);
+    heap_free_sized(firstBlock, 500); // log: Block of 104 bytes freed as 500 bytes (debug builds)
+    assert(heap_get_used_blocks_count() == usedBlocks); // still freed
+    firstBlock = heap_malloc(100);
+    firstBlock = heap_realloc_sized(firstBlock, 100, 400); // grows under the one arena lock
+    assert(firstBlock != NULL && heap_get_block_size(firstBlock) == 400);
+    heap_free_sized(firstBlock, 400);
+    heap_set_option(option_mmap_threshold, 16 * PAGE_SIZE);
+    firstBlock = heap_malloc(100000);
+    heap_free_sized(firstBlock, 100000); // straight to the mappings
+    assert(get_pointer_type(firstBlock) != pointer_valid);
+    heap_set_option(option_mmap_threshold, 0);
+    assert(heap_get_used_blocks_count() == usedBlocks);
+    assert(heap_validate() == 0);
+
+    heap_set_option(option_profile_sample_rate, 1); // every allocation is sampled
+    firstBlock = heap_malloc_ts_debug(1000, 300, "main.c"); // line numbers above 255 aren't truncated
+    secondBlock = heap_malloc_ts_debug(500, 300, "main.c");
+    heap_free(secondBlock);
+    struct heap_profile_site_t sites[4];
+    assert(heap_profile_get(sites, 4) == 1);
+    assert(sites[0].lineNumber == 300 && sites[0].liveBytes == 1000 && sites[0].allocatedBytes == 1500);
+    assert(sites[0].allocations == 2 && sites[0].averageLifetime >= 0);
+    assert(heap_realloc_ts_debug(firstBlock, 10000000000, 301, "main.c") == NULL); // log: Couldn't get enough space from OS
+    assert(heap_profile_get(sites, 4) == 1 && sites[0].liveBytes == 1000); // the block and its sample stay
+    heap_free(firstBlock);
+    assert(heap_profile_dump("/tmp/heap_profile.txt") == 0);
+    heap_set_option(option_profile_sample_rate, 0);
+
+    firstBlock = heap_malloc_ts_debug(100, 42, "main.c");
+    Arena* pinned[2] = { heap_arena_create(PAGE_SIZE * 4), heap_arena_create(PAGE_SIZE * 4) };
+    secondBlock = heap_arena_malloc(pinned[1], 100);
+    int fd = open("/tmp/heap_snapshot.jsonl", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(heap_snapshot(fd) == 0); // one JSON line per arena, chunk and large block, then the summary
+    close(fd);
+    assert(pinned[0]->pins == 0 && pinned[1]->pins == 0); // written out without arenasMutex, unpinned after
+    assert(heap_snapshot(-1) == -1); // log: Couldn't write the snapshot
+    heap_free(secondBlock);
+    heap_arena_destroy(pinned[0]);
+    heap_arena_destroy(pinned[1]);
+    heap_free(firstBlock);
+
+    struct heap_stats_t stats;
+    firstBlock = heap_malloc(1000);
+    secondBlock = heap_malloc(1000);
+    heap_free(firstBlock); // leaves a gap in front of secondBlock
+    assert(heap_get_stats(&stats) == 0);
+    uint64_t histogramBlocks = 0;
+    for(int i = 0; i < FREE_HISTOGRAM_BUCKETS; ++i)
+        histogramBlocks += stats.freeHistogram[i];
+    assert(histogramBlocks == stats.freeBlocks && stats.freeBlocks >= 2);
+    assert(stats.fragmentation > 0 && stats.fragmentation < 1);
+    assert(stats.osBytes == stats.usedSpace + stats.freeSpace); // no private arenas or large blocks left
+    assert(stats.peakOsBytes >= stats.osBytes);
+    heap_free(secondBlock);
+
+    heap_set_option(option_thread_cache_limit, 65536);
+    void* cached[10];
+    for(int i = 0; i < 10; ++i)
+        cached[i] = heap_malloc(100);
+    for(int i = 0; i < 10; ++i)
+        heap_free(cached[i]); // parked in the thread cache
+    assert(heap_get_stats(&stats) == 0);
+    assert(heap_get_used_space() == stats.usedSpace && heap_get_free_space() == stats.freeSpace); // one view of cached blocks
+    assert(heap_get_free_gaps_count() == stats.freeBlocks && heap_get_largest_free_area() == stats.largestFreeArea);
+    heap_set_option(option_thread_cache_limit, 0);
+
+    fd = open("/tmp/heap_trace.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(heap_trace_start(fd) == 0);
+    assert(heap_trace_start(fd) == -1); // log: Trace is already running
+    firstBlock = heap_malloc(100);
+    firstBlock = heap_realloc(firstBlock, 200);
+    heap_free(firstBlock);
+    assert(heap_trace_stop() == 0);
+    assert(lseek(fd, 0, SEEK_END) == 8 + 3 * sizeof(struct heap_trace_record_t)); // magic and one record per call
+    close(fd);
+    assert(heap_trace_stop() == -1); // log: Trace isn't running
+
+    void* run[3];
+    assert(heap_malloc_batch(1000, 3, run) == 3); // three neighbours
+    heap_free(run[0]);
+    memset(run[1], 7, 1000);
+    newMemory = heap_realloc(run[1], 1800); // takes in the free chunk before it, data moves down
+    assert((uint8_t*)newMemory <= (uint8_t*)run[0] && ((uint8_t*)newMemory)[999] == 7);
+    heap_free(newMemory);
+    heap_free(run[2]);
+    size_t largest = heap_get_largest_free_area();
+    firstBlock = heap_malloc(largest + PAGE_SIZE); // fits nowhere, so it ends the heap
+    newMemory = heap_realloc(firstBlock, largest + 20 * PAGE_SIZE);
+    assert(newMemory == firstBlock); // heap grew under it
+    heap_free(newMemory);
+    assert(heap_validate() == 0);
+
+    assert(heap_set_option(option_placement_policy, placement_best_fit) == -1); // log: Placement policy can only be set before heap_setup
+    assert(heap_set_option(option_placement_policy, placement_best_fit + 1) == -1); // log: Invalid option
+
+    heap_set_option(option_deferred_coalescing, 4096);
+    void* parked = heap_malloc(64);
+    void* neighbour = heap_malloc(64);
+    uint64_t gaps = heap_get_free_gaps_count();
+    heap_free(parked);
+    assert(heap_get_free_gaps_count() == gaps + 1); // parked, not merged
+    assert(get_pointer_type(parked) == pointer_unallocated);
+    heap_free(parked); // log: Double free deteched
+    assert(heap_malloc(64) == parked); // same size takes it back
+    heap_free(parked);
+    heap_free(neighbour);
+    assert(heap_get_free_gaps_count() == gaps + 2);
+    assert(heap_validate() == 0);
+    heap_trim(SIZE_MAX); // parked run merges with its free neighbours
+    assert(heap_get_free_gaps_count() <= gaps);
+    heap_set_option(option_deferred_coalescing, 0);
+    assert(heap_validate() == 0);
+
+    assert(heap_set_option(option_adaptive_locks, 1) == -1); // log: Lock type can only be set before heap_setup
+
+    int pass;
+    while((pass = heap_validate_step(16)) == 0);
+    assert(pass == 1);
+    assert(heap_validate_step(0) == -1); // log: Invalid budget
+    assert(heap_validator_stop() == -1); // log: Validator isn't running
+    assert(heap_validator_start(64, 1000) == 0);
+    assert(heap_validator_start(64, 1000) == -1); // log: Validator is already running
+    void* checked[32];
+    for(int i = 0; i < 32; ++i)
+        checked[i] = heap_malloc(16 + i * 24);
+    for(int i = 0; i < 32; i += 2)
+        heap_free(checked[i]);
+    for(int i = 1; i < 32; i += 2)
+        heap_free(checked[i]);
+    assert(heap_validator_stop() == 0);
+
     return 0;
 }